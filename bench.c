@@ -0,0 +1,183 @@
+#include "node.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_NICKNAMES 65536
+#define BENCH_ROUNDS 64
+
+/* node_compare as it was before being specialized: one byte at a time through CASEMAPPING.tolower. */
+size_t bench_compare_generic(void *x, void *y, size_t offset, size_t size) {
+    unsigned char *x_nickname = x,
+                  *y_nickname = y;
+    size_t hi = offset / CHAR_BIT;
+
+    while (hi < size && CASEMAPPING.tolower(x_nickname[hi]) == CASEMAPPING.tolower(y_nickname[hi])) {
+        hi++;
+    }
+
+    size_t lo = hi > offset / CHAR_BIT
+              ? ~0U % CHAR_BIT
+              : ~offset % CHAR_BIT,
+           sum = hi < size
+               ? (size_t) (CASEMAPPING.tolower(x_nickname[hi]) ^ CASEMAPPING.tolower(y_nickname[hi]))
+               : ~0U % UCHAR_MAX;
+
+    while (lo > 0 && sum >> lo == 0) {
+        lo--;
+    }
+
+    return hi * CHAR_BIT + ~lo % CHAR_BIT;
+}
+
+/* node_compare with the common prefix skipped eight bytes a step through CASEMAPPING_TOLOWER, unrolled,
+ * instead of folded a word at a time by node_fold. */
+size_t bench_compare_unrolled(void *x, void *y, size_t offset, size_t size) {
+    unsigned char *x_nickname = x,
+                  *y_nickname = y;
+    size_t hi = offset / CHAR_BIT;
+
+    while (hi + 8 <= size
+        && CASEMAPPING_TOLOWER(x_nickname[hi])     == CASEMAPPING_TOLOWER(y_nickname[hi])
+        && CASEMAPPING_TOLOWER(x_nickname[hi + 1]) == CASEMAPPING_TOLOWER(y_nickname[hi + 1])
+        && CASEMAPPING_TOLOWER(x_nickname[hi + 2]) == CASEMAPPING_TOLOWER(y_nickname[hi + 2])
+        && CASEMAPPING_TOLOWER(x_nickname[hi + 3]) == CASEMAPPING_TOLOWER(y_nickname[hi + 3])
+        && CASEMAPPING_TOLOWER(x_nickname[hi + 4]) == CASEMAPPING_TOLOWER(y_nickname[hi + 4])
+        && CASEMAPPING_TOLOWER(x_nickname[hi + 5]) == CASEMAPPING_TOLOWER(y_nickname[hi + 5])
+        && CASEMAPPING_TOLOWER(x_nickname[hi + 6]) == CASEMAPPING_TOLOWER(y_nickname[hi + 6])
+        && CASEMAPPING_TOLOWER(x_nickname[hi + 7]) == CASEMAPPING_TOLOWER(y_nickname[hi + 7])) {
+        hi += 8;
+    }
+
+    while (hi < size && CASEMAPPING_TOLOWER(x_nickname[hi]) == CASEMAPPING_TOLOWER(y_nickname[hi])) {
+        hi++;
+    }
+
+    size_t lo = hi > offset / CHAR_BIT
+              ? ~0U % CHAR_BIT
+              : ~offset % CHAR_BIT,
+           sum = hi < size
+               ? (size_t) (CASEMAPPING_TOLOWER(x_nickname[hi]) ^ CASEMAPPING_TOLOWER(y_nickname[hi]))
+               : ~0U % UCHAR_MAX;
+
+    while (lo > 0 && sum >> lo == 0) {
+        lo--;
+    }
+
+    return hi * CHAR_BIT + ~lo % CHAR_BIT;
+}
+
+/* Fills nickname with a random name of at least half of NICKLEN, padded with '\0'. */
+void bench_nickname(char *nickname) {
+    static const char letters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ[]\\^{}|~-_0123456789";
+    size_t size = NICKLEN / 2 + rand() % (NICKLEN - NICKLEN / 2 + 1);
+
+    memset(nickname, 0, NICKLEN);
+    for (size_t x = 0; x < size; x++) {
+        nickname[x] = letters[rand() % (sizeof letters - 1)];
+    }
+}
+
+/* Flips the case of each character the casemapping folds, so lookups must fold to match. */
+void bench_swapcase(char *nickname) {
+    for (size_t x = 0; x < NICKLEN; x++) {
+        unsigned char c = nickname[x];
+        if (CASEMAPPING_TOLOWER(c) != c) {
+            nickname[x] = CASEMAPPING_TOLOWER(c);
+        }
+        else if (c >= 'a' && c <= CASEMAPPING_UPPER + ('a' - 'A')) {
+            nickname[x] = c - ('a' - 'A');
+        }
+    }
+}
+
+double bench_ns(clock_t start, size_t operations) {
+    return 1e9 * (clock() - start) / CLOCKS_PER_SEC / operations;
+}
+
+int main(void) {
+    static char nickname[BENCH_NICKNAMES][NICKLEN], other[BENCH_NICKNAMES][NICKLEN];
+    nodeinfo *list = NULL;
+    srand(1);
+
+    /* Pairs share a prefix differing only by case, so comparisons scan a realistic distance. */
+    for (size_t x = 0; x < BENCH_NICKNAMES; x++) {
+        bench_nickname(nickname[x]);
+        bench_nickname(other[x]);
+
+        size_t prefix = rand() % (NICKLEN + 1);
+        memcpy(other[x], nickname[x], prefix);
+        bench_swapcase(other[x]);
+
+        node *n = nodeinfo_add(&list, &(node){ .evaluate = node_unused });
+        if (n == NULL) {
+            fputs("FATAL: Out of memory.", stderr);
+            return EXIT_FAILURE;
+        }
+
+        memcpy(n->nickname, nickname[x], NICKLEN);
+        if (nodeinfo_get(&list, n->nickname, NICKLEN) == NULL) {
+            nodeinfo_insert(&list, n);
+        }
+    }
+
+    size_t sink = 0, operations = (size_t) BENCH_NICKNAMES * BENCH_ROUNDS;
+    for (size_t x = 0; x < BENCH_NICKNAMES; x++) {
+        assert(node_compare(nickname[x], other[x], 0, NICKLEN) == bench_compare_generic(nickname[x], other[x], 0, NICKLEN));
+        assert(bench_compare_unrolled(nickname[x], other[x], 0, NICKLEN) == bench_compare_generic(nickname[x], other[x], 0, NICKLEN));
+    }
+
+    clock_t start = clock();
+    for (size_t round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t x = 0; x < BENCH_NICKNAMES; x++) {
+            sink += bench_compare_generic(nickname[x], other[x], 0, NICKLEN);
+        }
+    }
+    double generic = bench_ns(start, operations);
+
+    start = clock();
+    for (size_t round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t x = 0; x < BENCH_NICKNAMES; x++) {
+            sink += bench_compare_unrolled(nickname[x], other[x], 0, NICKLEN);
+        }
+    }
+    double unrolled = bench_ns(start, operations);
+
+    start = clock();
+    for (size_t round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t x = 0; x < BENCH_NICKNAMES; x++) {
+            sink += node_compare(nickname[x], other[x], 0, NICKLEN);
+        }
+    }
+    double compare = bench_ns(start, operations);
+
+    for (size_t x = 0; x < BENCH_NICKNAMES; x++) {
+        bench_swapcase(nickname[x]);
+    }
+
+    start = clock();
+    for (size_t round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t x = 0; x < BENCH_NICKNAMES; x++) {
+            sink += nodeinfo_get(&list, nickname[x], NICKLEN) != NULL;
+        }
+    }
+    double lookup = bench_ns(start, operations);
+
+    start = clock();
+    for (size_t round = 0; round < BENCH_ROUNDS; round++) {
+        for (size_t x = 0; x < BENCH_NICKNAMES; x++) {
+            sink += mask_match("*a*b*", 5, nickname[x], NICKLEN);
+        }
+    }
+    double match = bench_ns(start, operations);
+
+    printf("NICKLEN=%d CASEMAPPING=%s: node_compare %.1f ns (%.1f ns unrolled, %.1f ns generic), nodeinfo_get %.1f ns, mask_match %.1f ns [%zu]\n",
+           NICKLEN, CASEMAPPING.description, compare, unrolled, generic, lookup, match, sink);
+
+    free(list);
+    return EXIT_SUCCESS;
+}
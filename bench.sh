@@ -0,0 +1,43 @@
+#!/bin/sh
+# Rebuilds bench for each NICKLEN and CASEMAPPING over the configuration given, default_config.h by
+# default, and prints node_compare in ns per call with the unrolled and generic comparisons in
+# parentheses. CC, CFLAGS and LIBS are passed to the compiler; on Windows set LIBS=-lws2_32.
+
+CONFIG=${1:-default_config.h}
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+NICKLENS="9 16 32"
+CASEMAPPINGS="ascii strict_rfc1459 rfc1459"
+
+case $CONFIG in
+    /*) ;;
+    *) CONFIG=$(pwd)/$CONFIG ;;
+esac
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+printf '%-16s' CASEMAPPING
+for n in $NICKLENS; do
+    printf '  %-24s' "NICKLEN=$n"
+done
+printf '\n'
+
+for m in $CASEMAPPINGS; do
+    printf '%-16s' "$m"
+    for n in $NICKLENS; do
+        cat > "$dir/config.h" <<EOF
+#include "$CONFIG"
+#undef NICKLEN
+#define NICKLEN $n
+#undef CASEMAPPING
+#define CASEMAPPING $m
+EOF
+        $CC $CFLAGS -DCONFIG="\"$dir/config.h\"" --std=c99 -o "$dir/bench" bench.c capture.c history.c mask.c node.c $LIBS || exit 1
+        "$dir/bench" | sed -n 's/.*node_compare \([0-9.]*\) ns (\([0-9.]*\) ns unrolled, \([0-9.]*\) ns generic).*/\1 (\2, \3)/p' | {
+            read -r result
+            printf '  %-24s' "$result"
+        }
+    done
+    printf '\n'
+done
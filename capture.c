@@ -0,0 +1,91 @@
+#include "capture.h"
+
+#include <string.h>
+#include <time.h>
+
+capturelog capture;
+
+/* Writes a record of what a client connection did: opened, sent the server data, or closed. */
+void capturelog_append(capturelog *c, int type, size_t connection, char *data, size_t size) {
+    if (c->file == NULL) {
+        return;
+    }
+
+    unsigned long long elapsed = capturelog_clock() - c->base;
+    unsigned char record[CAPTURELOG_RECORD] = { type,
+                                                connection >> 24 & 0xFF, connection >> 16 & 0xFF, connection >> 8 & 0xFF, connection & 0xFF,
+                                                elapsed >> 24 & 0xFF, elapsed >> 16 & 0xFF, elapsed >> 8 & 0xFF, elapsed & 0xFF,
+                                                size >> 8 & 0xFF, size & 0xFF };
+
+    /* A short write only loses the tail of the capture, which the reader stops at. */
+    fwrite(record, 1, sizeof record, c->file);
+    if (size > 0) {
+        fwrite(data, 1, size, c->file);
+    }
+}
+
+unsigned long long capturelog_clock(void) {
+#   ifdef WIN32
+    return GetTickCount();
+#   else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000ULL + t.tv_nsec / 1000000;
+#   endif
+}
+
+void capturelog_flush(capturelog *c) {
+    if (c->file != NULL) {
+        fflush(c->file);
+    }
+}
+
+/* Opens a log to append to with mode "ab+", starting it if it's empty, or to replay with "rb".
+ * The monotonic clock starts over with the machine, so appending starts a new base and marks it with
+ * a CAPTURE_BASE record, rather than carrying on a timeline a reboot may have broken. */
+int capturelog_open(capturelog *c, char *path, char *mode) {
+    FILE *f = fopen(path, mode);
+    if (f == NULL) {
+        return 0;
+    }
+
+    unsigned char header[CAPTURELOG_HEADER];
+    rewind(f);
+    size_t size = fread(header, 1, sizeof header, f);
+
+    if (size == 0 && mode[0] == 'a') {
+        if (fseek(f, 0, SEEK_END) != 0 || fwrite(CAPTURELOG_MAGIC, 1, sizeof header, f) != sizeof header) {
+            fclose(f);
+            return 0;
+        }
+    }
+    else if (size != sizeof header || memcmp(header, CAPTURELOG_MAGIC, sizeof CAPTURELOG_MAGIC) != 0
+          || (mode[0] == 'a' && fseek(f, 0, SEEK_END) != 0)) {
+        fclose(f);
+        return 0;
+    }
+
+    c->file = f;
+    c->base = capturelog_clock();
+    if (mode[0] == 'a') {
+        capturelog_append(c, CAPTURE_BASE, 0, NULL, 0);
+    }
+
+    return 1;
+}
+
+/* Reads the next record into data, which must hold 65535 bytes. Returns 0 at the end of the log,
+ * including a record cut short by the server stopping mid-write. */
+int capturelog_read(capturelog *c, int *type, size_t *connection, unsigned long long *elapsed, char *data, size_t *size) {
+    unsigned char record[CAPTURELOG_RECORD];
+    if (fread(record, 1, sizeof record, c->file) != sizeof record) {
+        return 0;
+    }
+
+    *type = record[0];
+    *connection = (size_t) record[1] << 24 | (size_t) record[2] << 16 | (size_t) record[3] << 8 | record[4];
+    *elapsed = (unsigned long long) record[5] << 24 | (unsigned long long) record[6] << 16 | (unsigned long long) record[7] << 8 | record[8];
+    *size = (size_t) record[9] << 8 | record[10];
+
+    return fread(data, 1, *size, c->file) == *size;
+}
@@ -0,0 +1,30 @@
+#ifndef INCLUDE_CAPTURE_H
+#define INCLUDE_CAPTURE_H
+
+#include "sock.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define CAPTURELOG_MAGIC "expircd capture 2"
+#define CAPTURELOG_HEADER (sizeof CAPTURELOG_MAGIC)
+#define CAPTURELOG_RECORD 11 /* type, then connection, milliseconds and size, big-endian in 4, 4 and 2 bytes */
+
+#define CAPTURE_BASE  'B' /* the server opened the log; later records count milliseconds from here */
+#define CAPTURE_OPEN  'O'
+#define CAPTURE_DATA  'D'
+#define CAPTURE_CLOSE 'C'
+
+typedef struct capturelog {
+    FILE *file;              /* NULL unless capturing */
+    unsigned long long base; /* capturelog_clock when the log was opened; records count milliseconds from it */
+} capturelog;
+
+extern capturelog capture;
+
+void capturelog_append(capturelog *, int, size_t, char *, size_t);
+unsigned long long capturelog_clock(void);
+void capturelog_flush(capturelog *);
+int capturelog_open(capturelog *, char *, char *);
+int capturelog_read(capturelog *, int *, size_t *, unsigned long long *, char *, size_t *);
+#endif
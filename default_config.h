@@ -6,7 +6,16 @@
 
 #define HOSTNAME "misconfigured.expircd"
 #define SERVICE { .bindaddr = NULL, .bindport = "6667", .type = server_accept }, \
-                { .bindaddr = NULL, .bindport = "7000", .type = server_accept },
+                { .bindaddr = NULL, .bindport = "7000", .type = server_accept }, \
+                /* { .bindaddr = "127.0.0.1", .bindport = "7001", .type = server_link_accept }, */
+
+/* Server links are not authenticated: anything that can reach a link port may introduce users and
+ * speak as them. Only accept links on trusted interfaces. */
+#define LINK /* { .connectaddr = "127.0.0.1", .connectport = "7001" }, */
+#define LINKBATCH 65536 /* bytes of records a server link collects before writing them out during a burst */
+
+#define BAN { .mask = "*!*@192.0.2.0/24", .reason = "Documentation addresses may not connect" }, \
+            { .mask = "*!root@*", .reason = "Do not IRC as root" },
 
 #define NICKLEN 32
 #define USERLEN 32
@@ -15,7 +24,28 @@
 #define TOPICLEN 384
 #define KEYLEN 32
 
+#define MAXTARGETS 4
+#define BROADCASTS 8 /* NICK and QUIT broadcasts that may be in progress at once; more wait for one to finish */
+
+#define TAGLEN 8191 /* bytes of IRCv3 message tags per line, allocated only for clients that negotiate them */
+
+#define HISTORYFILE "expircd.history"
+#define HISTORYSIZE (64 << 20) /* bytes of channel messages kept, shared by every channel */
+#define HISTORYLEN 100         /* messages each channel keeps for CHATHISTORY */
+
+/* Channel messages are sent to members from the history as their connections take them, so a
+ * member whose client falls more than HISTORYLEN messages behind in a channel, or whose next
+ * message is overwritten in HISTORYSIZE first, is disconnected with "SendQ exceeded" rather than
+ * silently miss lines. */
+
+/* Records every client connection's inbound bytes for replay against another build; the log holds
+ * everything clients send, so keep it private. */
+/* #define CAPTUREFILE "expircd.capture" */
+
 
 #define CASEMAPPING rfc1459
 
+#define QUANTUM 4 /* lines each connection may evaluate per turn before it is put back on the run queue */
+#define FANOUT 256 /* messages each channel may send its members per turn before it is put back on the run queue; see HISTORYLEN for members left behind */
+
 #endif
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "history.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+historylog history;
+
+size_t historylog_append(historylog *h, size_t previous, size_t except, int quiet, size_t tags, char *data, size_t size) {
+    size_t entry_size = sizeof (historyentry) + size;
+    entry_size += (sizeof (historyentry) - entry_size % sizeof (historyentry)) % sizeof (historyentry);
+    if (entry_size > h->size) {
+        return previous;
+    }
+
+    historyentry *p = historylog_entry(h, previous);
+    size_t sequence = p ? p->sequence + 1 : 0;
+
+    /* Entries don't wrap; one that won't fit before the end of the ring starts over at the beginning. */
+    size_t head = h->header->head;
+    if (head % h->size + entry_size > h->size) {
+        head += h->size - head % h->size;
+    }
+
+    historyentry *e = (historyentry *) (h->data + head % h->size);
+    *e = (historyentry) { .previous = previous,
+                          .sequence = sequence,
+                          .time = time(NULL),
+                          .except = except,
+                          .quiet = quiet,
+                          .tags = tags,
+                          .size = size };
+    memcpy(e + 1, data, size);
+
+    /* Link the previous entry forward, unless the new one has just overwritten it. */
+    h->header->head = head + entry_size;
+    p = historylog_entry(h, previous);
+    if (p != NULL) {
+        p->next = head + 1;
+    }
+
+    return head + 1;
+}
+
+historyentry *historylog_entry(historylog *h, size_t position) {
+    if (position-- == 0 || position >= h->header->head || h->header->head - position > h->size) {
+        return NULL;
+    }
+
+    /* The file may have been written by an older build or damaged, so don't trust a size to stay within the ring. */
+    historyentry *e = (historyentry *) (h->data + position % h->size);
+    if (h->size - position % h->size < sizeof *e || e->size > h->size - position % h->size - sizeof *e || e->tags > e->size) {
+        return NULL;
+    }
+
+    return e;
+}
+
+int historylog_open(historylog *h, char *path, size_t size) {
+    size_t header_size = sizeof *h->header;
+    header_size += (sizeof (historyentry) - header_size % sizeof (historyentry)) % sizeof (historyentry);
+    size -= size % sizeof (historyentry);
+
+#   ifdef WIN32
+    /* No mapping here; the log lives in memory and starts empty. */
+    void *map = calloc(1, header_size + size);
+    if (map == NULL) {
+        return 0;
+    }
+#   else
+    /* The log is a shared file mapping, so the OS pages cold history out to the file
+     * instead of swap, and the log is still there after a restart. */
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return 0;
+    }
+
+    /* Two servers appending to one ring would overwrite each other's entries. The lock is held
+     * for as long as the descriptor stays open, which is until exit or a restart's exec. */
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(fd, header_size + size) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, header_size + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+#   endif
+
+    h->header = map;
+    h->data = (char *) map + header_size;
+    h->size = size;
+
+    if (memcmp(h->header->magic, HISTORYLOG_MAGIC, sizeof HISTORYLOG_MAGIC) != 0) {
+        memcpy(h->header->magic, HISTORYLOG_MAGIC, sizeof HISTORYLOG_MAGIC);
+        h->header->size = size;
+        h->header->head = 0;
+    }
+    else if (h->header->size != size) {
+        /* Resized; skip far enough ahead that every existing position reads as overwritten. */
+        h->header->head += h->header->size + size;
+        h->header->size = size;
+    }
+
+    return 1;
+}
+
+time_t historylog_timestamp(char *s, size_t size) {
+    char t[sizeof "YYYY-MM-DDThh:mm:ss"];
+    int year, month, day, hour, minute, second, n = 0;
+
+    if (size < sizeof t - 1) {
+        return -1;
+    }
+
+    memcpy(t, s, sizeof t - 1);
+    t[sizeof t - 1] = '\0';
+
+    if (sscanf(t, "%4d-%2d-%2dT%2d:%2d:%2d%n", &year, &month, &day, &hour, &minute, &second, &n) != 6 || n != sizeof t - 1
+     || year < 1970 || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+        return -1;
+    }
+
+    /* Days since 1970-01-01 in the proleptic Gregorian calendar, with years starting in March. */
+    year -= month <= 2;
+    long era = year / 400, year_of_era = year - era * 400,
+         day_of_year = (153L * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1,
+         day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+    return (time_t) (era * 146097 + day_of_era - 719468) * 86400 + hour * 3600 + minute * 60 + second;
+}
@@ -0,0 +1,38 @@
+#ifndef INCLUDE_HISTORY_H
+#define INCLUDE_HISTORY_H
+
+#include "sock.h"
+
+#include <stddef.h>
+#include <time.h>
+
+#define HISTORYLOG_MAGIC "expircd history 4"
+
+typedef struct historyentry {
+    size_t previous; /* position of the channel's previous entry plus one, or zero */
+    size_t next;     /* position of the channel's next entry plus one, or zero until there is one */
+    size_t sequence; /* entries the channel logged before this one, as far back as the log reaches */
+    time_t time;
+    size_t except;   /* index of the member the line isn't delivered to plus one, or zero */
+    unsigned int quiet:1; /* delivered but left out of replays */
+    size_t tags;     /* bytes of the tag section the line starts with, sent only to clients that negotiated message-tags */
+    size_t size;     /* bytes of the line following the entry, as it was sent */
+} historyentry;
+
+typedef struct historylog {
+    struct {
+        char magic[sizeof HISTORYLOG_MAGIC];
+        size_t size;
+        size_t head; /* bytes ever appended; entries older than head - size are overwritten */
+    } *header;       /* the start of the mapping, so the log outlives a restart */
+    char *data;      /* size bytes following the header, used as a ring */
+    size_t size;
+} historylog;
+
+extern historylog history;
+
+size_t historylog_append(historylog *, size_t, size_t, int, size_t, char *, size_t);
+historyentry *historylog_entry(historylog *, size_t);
+int historylog_open(historylog *, char *, size_t);
+time_t historylog_timestamp(char *, size_t);
+#endif
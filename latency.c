@@ -0,0 +1,192 @@
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#define LATENCY_CHANNEL "#latency"
+#define LATENCY_TIMEOUT 10000 /* milliseconds a probe may take before the run is given up */
+
+/* The load each loading connection sends per round: the streamed replies and a relay to a channel
+ * and three users, the lines a turn's quantum is charged for. */
+#define LATENCY_LOAD "LIST\r\nNAMES " LATENCY_CHANNEL "\r\nWHO " LATENCY_CHANNEL "\r\nPRIVMSG " LATENCY_CHANNEL ",load0,load1,load2 :load\r\n"
+
+/* Reads what the server has sent, keeping the last of it in data, of capacity size and holding
+ * *data_size bytes, when data is given; the rest is thrown away, so the server never blocks. */
+int latency_recv(sockfd fd, char *data, size_t size, size_t *data_size) {
+    char buffer[4096];
+    int n;
+
+    while ((n = recv(fd, buffer, sizeof buffer, 0)) > 0) {
+        if (data == NULL) {
+            continue;
+        }
+
+        size_t keep = (size_t) n < size - 1 ? (size_t) n : size - 1;
+        if (*data_size + keep > size - 1) {
+            size_t drop = *data_size + keep - (size - 1);
+            memmove(data, data + drop, *data_size - drop);
+            *data_size -= drop;
+        }
+
+        memcpy(data + *data_size, buffer + n - keep, keep);
+        *data_size += keep;
+        data[*data_size] = '\0';
+    }
+
+    return n < 0 && sock_again(fd) ? 1 : n;
+}
+
+void latency_sleep(unsigned long long milliseconds) {
+#   ifdef WIN32
+    Sleep(milliseconds);
+#   else
+    usleep(milliseconds * 1000);
+#   endif
+}
+
+/* Sends all of data, reading meanwhile so the server isn't kept waiting to send its replies. */
+int latency_send(sockfd fd, char *data) {
+    for (size_t size = strlen(data), x = 0; x < size; ) {
+        int n = send(fd, data + x, size - x, 0);
+        if (n < 0 && !sock_again(fd)) {
+            return 0;
+        }
+
+        if (n > 0) {
+            x += n;
+            continue;
+        }
+
+        if (latency_recv(fd, NULL, 0, NULL) <= 0) {
+            return 0;
+        }
+
+        latency_sleep(1);
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 5) {
+        fputs("Usage: latency host port [connections [rounds]]\n"
+              "Times a probe's PRIVMSG to itself while other connections keep the server busy with LIST, NAMES, WHO and relays.\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    size_t size = argc > 3 ? strtoul(argv[3], NULL, 10) : 64,
+           rounds = argc > 4 ? strtoul(argv[4], NULL, 10) : 100;
+
+#   ifdef WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa)) {
+        fputs("FATAL: WSAStartup failed.", stderr);
+        return EXIT_FAILURE;
+    }
+#   endif
+
+    addrinfo *addr;
+    if (getaddrinfo(argv[1], argv[2], &(addrinfo){ .ai_family = AF_UNSPEC,
+                                                   .ai_socktype = SOCK_STREAM }, &addr) != 0) {
+        fputs("FATAL: Resolving the server failed.", stderr);
+        return EXIT_FAILURE;
+    }
+
+    /* The probe is the last connection. */
+    sockfd *fd = malloc((size + 1) * sizeof *fd);
+    if (fd == NULL) {
+        fputs("FATAL: Out of memory.", stderr);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t x = 0; x <= size; x++) {
+        char line[sizeof "NICK load18446744073709551615\r\nUSER latency 0 * :latency\r\nJOIN " LATENCY_CHANNEL "\r\n"];
+        if (x < size) {
+            sprintf(line, "NICK load%zu\r\nUSER latency 0 * :latency\r\nJOIN " LATENCY_CHANNEL "\r\n", x);
+        }
+        else {
+            strcpy(line, "NICK probe\r\nUSER latency 0 * :latency\r\n");
+        }
+
+        fd[x] = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (sock_invalid(fd[x]) || connect(fd[x], addr->ai_addr, addr->ai_addrlen) != 0 || !set_nonblock(fd[x]) || !latency_send(fd[x], line)) {
+            fprintf(stderr, "FATAL: Connecting connection %zu failed.\n", x);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* The server may accept a connection a second when idle, so the probe, which is last, is given
+     * as long again to be welcomed. */
+    char data[4096];
+    size_t data_size = 0;
+    unsigned long long start = capturelog_clock();
+    while (strstr(data_size ? data : "", " 001 ") == NULL) {
+        for (size_t x = 0; x < size; x++) {
+            latency_recv(fd[x], NULL, 0, NULL);
+        }
+
+        if (latency_recv(fd[size], data, sizeof data, &data_size) <= 0 || capturelog_clock() - start > LATENCY_TIMEOUT + 1000 * size) {
+            fputs("FATAL: The probe wasn't welcomed.\n", stderr);
+            return EXIT_FAILURE;
+        }
+
+        latency_sleep(1);
+    }
+
+    unsigned long long total = 0, min = ~0ULL, max = 0;
+    for (size_t round = 0; round < rounds; round++) {
+        for (size_t x = 0; x < size; x++) {
+            if (!latency_send(fd[x], LATENCY_LOAD)) {
+                fprintf(stderr, "FATAL: Connection %zu was closed.\n", x);
+                return EXIT_FAILURE;
+            }
+        }
+
+        char line[sizeof "PRIVMSG probe :18446744073709551615\r\n"];
+        sprintf(line, "PRIVMSG probe :%zu\r\n", round);
+        data_size = 0;
+        start = capturelog_clock();
+        if (!latency_send(fd[size], line)) {
+            fputs("FATAL: The probe was closed.\n", stderr);
+            return EXIT_FAILURE;
+        }
+
+        while (strstr(data_size ? data : "", line) == NULL) {
+            for (size_t x = 0; x < size; x++) {
+                latency_recv(fd[x], NULL, 0, NULL);
+            }
+
+            if (latency_recv(fd[size], data, sizeof data, &data_size) <= 0 || capturelog_clock() - start > LATENCY_TIMEOUT) {
+                fprintf(stderr, "FATAL: Probe %zu didn't come back.\n", round);
+                return EXIT_FAILURE;
+            }
+
+            latency_sleep(1);
+        }
+
+        unsigned long long elapsed = capturelog_clock() - start;
+        total += elapsed;
+        min = elapsed < min ? elapsed : min;
+        max = elapsed > max ? elapsed : max;
+    }
+
+    printf("Probed %zu rounds over %zu loading connections; latency %llu ms min, %.1f ms mean, %llu ms max\n",
+           rounds, size, rounds ? min : 0, rounds ? (double) total / rounds : 0.0, max);
+
+    for (size_t x = 0; x <= size; x++) {
+        closesocket(fd[x]);
+    }
+
+    free(fd);
+    freeaddrinfo(addr);
+#   ifdef WIN32
+    WSACleanup();
+#   endif
+    return EXIT_SUCCESS;
+}
@@ -4,19 +4,52 @@
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifndef WIN32
+#include <signal.h>
+#include <sys/wait.h>
+
+volatile sig_atomic_t restart;
+
+/* Runs the binary at path on the snapshot alone, to learn whether it can take over from this one. */
+int main_check(char *path, char **argv) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("EXPIRCD_SNAPSHOT_CHECK", "1", 1);
+        execvp(path, argv);
+        _exit(EXIT_FAILURE);
+    }
+
+    int status;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+void main_restart(int signal) {
+    (void) signal;
+    restart = 1;
+}
+#endif
+
 typedef struct service {
     char *bindaddr;
     char *bindport;
     evaluator *type;
 } service;
 
-int main(void) {
+typedef struct peer {
+    char *connectaddr;
+    char *connectport;
+} peer;
+
+int main(int argc, char **argv) {
     addrinfo *addr;
     nodeinfo *node = NULL;
     service service[] = { SERVICE };
+    maskinfo ban[] = { BAN { 0 } };
+    peer link[] = { LINK { 0 } };
 
 #   ifdef WIN32
     WSADATA wsa;
@@ -26,7 +59,46 @@ int main(void) {
     }
 #   endif
 
-    for (size_t x = 0; x < sizeof service / sizeof *service; x++) {
+#   ifndef WIN32
+    /* After a restart, the listeners and connections are inherited and the snapshot restores their nodes. */
+    char *snapshot = getenv("EXPIRCD_SNAPSHOT");
+    if (snapshot != NULL) {
+        FILE *f = fdopen(atoi(snapshot), "rb");
+        if (f != NULL && fseek(f, 0, SEEK_SET) == 0) {
+            node = nodeinfo_load(f);
+        }
+
+        if (getenv("EXPIRCD_SNAPSHOT_CHECK") != NULL) {
+            return node != NULL ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        if (node == NULL) {
+            fputs("FATAL: Restoring the snapshot failed.", stderr);
+            return 0;
+        }
+
+        fclose(f);
+        unsetenv("EXPIRCD_SNAPSHOT");
+    }
+
+    /* Restarts run the binary by the name it was started by, a bare one being looked up on PATH
+     * again, and a relative one made absolute now. /proc/self/exe would name the old binary even
+     * once a rebuilt one has replaced it. */
+    char *path = argv[0], absolute[4096];
+    if (strchr(path, '/') != NULL && path[0] != '/' && getcwd(absolute, sizeof absolute) != NULL
+     && strlen(absolute) + 1 + strlen(path) < sizeof absolute) {
+        strcat(strcat(absolute, "/"), path);
+        path = absolute;
+    }
+
+    signal(SIGUSR2, main_restart);
+
+    /* A client that hangs up mid-send, as replayed captures do, must fail the send rather than kill the server. */
+    signal(SIGPIPE, SIG_IGN);
+#   endif
+
+    int restored = node != NULL;
+    for (size_t x = 0; !restored && x < sizeof service / sizeof *service; x++) {
         int n = getaddrinfo(service[x].bindaddr, service[x].bindport, &(addrinfo){ .ai_socktype = SOCK_STREAM,
                                                                                    .ai_family = AF_UNSPEC,
                                                                                    .ai_flags = AI_PASSIVE }, &addr);
@@ -40,21 +112,96 @@ int main(void) {
         return 0;
     }
 
+    for (size_t x = 0; !restored && link[x].connectaddr != NULL; x++) {
+        int n = getaddrinfo(link[x].connectaddr, link[x].connectport, &(addrinfo){ .ai_socktype = SOCK_STREAM,
+                                                                                 .ai_family = AF_UNSPEC }, &addr);
+        if (n != 0 || nodeinfo_connect(&node, addr) == NULL) {
+            fprintf(stderr, "ERROR: Linking to %s port %s failed.\n", link[x].connectaddr, link[x].connectport);
+        }
+
+        if (n == 0) {
+            freeaddrinfo(addr);
+        }
+    }
+
+    if (!banlist_compile(&bans, ban)) {
+        fputs("FATAL: Compiling the ban list failed.", stderr);
+        return 0;
+    }
+
+    if (!historylog_open(&history, HISTORYFILE, HISTORYSIZE)) {
+        fputs("FATAL: Opening the history log failed; is another server using it?", stderr);
+        return 0;
+    }
+
+#   ifdef CAPTUREFILE
+    if (!capturelog_open(&capture, CAPTUREFILE, "ab+")) {
+        fputs("FATAL: Opening the capture log failed.", stderr);
+        return 0;
+    }
+#   endif
+
     time_t start = time(NULL);
     size_t x = 0;
     for (;;) {
-        node->node[x].evaluate(node->node + x, &node);
+        /* A queued node runs when the queue is drained, so it gets the one quantum per pass. */
+        if (!node->node[x].run.queued) {
+            nodeinfo_run(&node, x);
+        }
 
         x++;
         if (x == node->size) {
+            x = 0;
+            nodeinfo_quiesce(&node);
+
+#           ifndef WIN32
+            if (restart) {
+                restart = 0;
+
+                /* Between turns no line is half parsed, so the nodes can be written out and the binary replaced.
+                 * It is handed over to only once it has loaded the snapshot on the side; one that can't, laying
+                 * nodes out differently, is refused and this one carries on with every client. */
+                FILE *f = tmpfile();
+                if (f != NULL && nodeinfo_save(&node, f)) {
+                    char fd[32];
+                    sprintf(fd, "%d", fileno(f));
+                    setenv("EXPIRCD_SNAPSHOT", fd, 1);
+                    fflush(stdout);
+                    capturelog_flush(&capture);
+
+                    if (main_check(path, argv)) {
+                        execvp(path, argv);
+                    }
+                    else {
+                        fputs("ERROR: The new binary can't load the snapshot.\n", stderr);
+                    }
+
+                    unsetenv("EXPIRCD_SNAPSHOT");
+                }
+
+                fputs("ERROR: Restart failed; continuing.\n", stderr);
+                if (f != NULL) {
+                    fclose(f);
+                }
+            }
+#           endif
+
+            if (nodeinfo_drain(&node) > 0) {
+                continue;
+            }
+
+            capturelog_flush(&capture);
+
             unsigned int y = 0;
             while (time(NULL) - start < 1) {
                 usleep(100000);
                 y++;
             }
-            printf("Checked %zu sockets and slept for %u.%u seconds\n", x, y / 10, y % 10);
+            printf("Checked %zu sockets and slept for %u.%u seconds; run queue delay %.3f ms mean, %.3f ms max over %zu\n",
+                   node->size, y / 10, y % 10,
+                   node->runqueue.count ? node->runqueue.delay / 1000.0 / node->runqueue.count : 0.0,
+                   node->runqueue.delay_max / 1000.0, node->runqueue.count);
             start++;
-            x = 0;
         }
     }
 
@@ -0,0 +1,308 @@
+#include "mask.h"
+#include "node.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+banlist bans;
+
+int ban_compare(const void *x, const void *y) {
+    const ban *x_ban = x, *y_ban = y;
+    if (x_ban->cidr != y_ban->cidr) {
+        return x_ban->cidr ? 1 : -1;
+    }
+
+    return ban_compare_prefix((ban *) x_ban, y_ban->field, y_ban->prefix, y_ban->prefix_size);
+}
+
+int ban_compare_prefix(ban *b, size_t field, char *prefix, size_t prefix_size) {
+    if (b->field != field) {
+        return b->field < field ? -1 : 1;
+    }
+
+    return field == BAN_SUFFIX ? mask_compare_suffix(b->prefix, b->prefix_size, prefix, prefix_size)
+                               : mask_compare(b->prefix, b->prefix_size, prefix, prefix_size);
+}
+
+int ban_match(ban *b, char *nickname, size_t nickname_size, char *username, size_t username_size, char *hostname, size_t hostname_size) {
+    return mask_match(b->nickname, b->nickname_size, nickname, nickname_size)
+        && mask_match(b->username, b->username_size, username, username_size)
+        && (b->cidr || mask_match(b->hostname, b->hostname_size, hostname, hostname_size));
+}
+
+int banlist_compile(banlist *b, maskinfo *info) {
+    size_t size = 0;
+    while (info[size].mask != NULL) {
+        size++;
+    }
+
+    *b = (banlist) { .size = size };
+    if (size == 0) {
+        return 1;
+    }
+
+    if (SIZE_MAX / sizeof *b->ban < size || (b->ban = malloc(size * sizeof *b->ban)) == NULL) {
+        return 0;
+    }
+
+    for (size_t x = 0; x < size; x++) {
+        ban *n = b->ban + x;
+        char *mask = info[x].mask, *at = strrchr(mask, '@'), *bang = strchr(mask, '!');
+
+        *n = (ban) { .info = info[x],
+                     .nickname = "*", .nickname_size = 1,
+                     .username = "*", .username_size = 1,
+                     .hostname = at ? at + 1 : mask };
+        n->hostname_size = strlen(n->hostname);
+
+        if (at != NULL && bang != NULL && bang < at) {
+            n->nickname = mask;
+            n->nickname_size = bang - mask;
+            n->username = bang + 1;
+            n->username_size = at - bang - 1;
+        }
+        else if (at != NULL) {
+            n->username = mask;
+            n->username_size = at - mask;
+        }
+
+        char *field[] = { n->hostname, n->nickname, n->username };
+        size_t field_size[] = { n->hostname_size, n->nickname_size, n->username_size };
+
+        for (size_t y = 0; y < sizeof field / sizeof *field; y++) {
+            size_t prefix_size = 0;
+            while (prefix_size < field_size[y] && field[y][prefix_size] != '*' && field[y][prefix_size] != '?') {
+                prefix_size++;
+            }
+
+            if (y == 0 || prefix_size > n->prefix_size) {
+                n->field = y;
+                n->prefix = field[y];
+                n->prefix_size = prefix_size;
+            }
+
+            if (y == 0 && prefix_size == field_size[y]) {
+                break;
+            }
+        }
+
+        /* Hostname globs such as *.isp.net have nothing literal but their suffix. */
+        size_t suffix_size = 0;
+        while (suffix_size < n->hostname_size && n->hostname[n->hostname_size - suffix_size - 1] != '*' && n->hostname[n->hostname_size - suffix_size - 1] != '?') {
+            suffix_size++;
+        }
+
+        if (suffix_size > n->prefix_size) {
+            n->field = BAN_SUFFIX;
+            n->prefix = n->hostname + n->hostname_size - suffix_size;
+            n->prefix_size = suffix_size;
+        }
+
+        if (n->field != 0 || n->prefix_size < n->hostname_size) {
+            continue;
+        }
+
+        char *slash = memchr(n->hostname, '/', n->hostname_size);
+        size_t bits = mask_address(n->hostname, slash ? (size_t) (slash - n->hostname) : n->hostname_size, n->address);
+        if (bits == 0) {
+            continue;
+        }
+
+        char *end;
+        unsigned long length = slash ? strtoul(slash + 1, &end, 10) : bits;
+        if (slash && (end != n->hostname + n->hostname_size || length > bits)) {
+            continue;
+        }
+
+        n->cidr = 1;
+        n->address_size = sizeof n->address * CHAR_BIT - bits + length;
+    }
+
+    /* Hostname globs sort first, by field and literal prefix or suffix; address prefixes follow and go in the radix tree. */
+    qsort(b->ban, size, sizeof *b->ban, ban_compare);
+    while (b->glob_size < size && !b->ban[b->glob_size].cidr) {
+        b->glob_size++;
+    }
+
+    if (b->glob_size < size && !banlist_grow(b)) {
+        return 0;
+    }
+
+    for (size_t x = b->glob_size; x < size; x++) {
+        ban *n = b->ban + x;
+        size_t r = 0;
+
+        for (size_t bit = 0; bit < n->address_size; bit++) {
+            size_t *next = b->radix[r].next + (n->address[bit / CHAR_BIT] >> (~bit % CHAR_BIT) & 1);
+            if (*next == 0) {
+                if (!banlist_grow(b)) {
+                    return 0;
+                }
+
+                next = b->radix[r].next + (n->address[bit / CHAR_BIT] >> (~bit % CHAR_BIT) & 1);
+                *next = b->radix_size - 1;
+            }
+
+            r = *next;
+        }
+
+        n->next = b->radix[r].ban;
+        b->radix[r].ban = x + 1;
+    }
+
+    return 1;
+}
+
+int banlist_grow(banlist *b) {
+    size_t old_size = b->radix_size, new_size = old_size + 1;
+    if ((old_size & new_size) == 0) {
+        if (SIZE_MAX / 2 / sizeof *b->radix <= new_size) { return 0; }
+
+        void *temp = realloc(b->radix, new_size * 2 * sizeof *b->radix);
+        if (temp == NULL) { return 0; }
+
+        b->radix = temp;
+    }
+
+    memset(b->radix + old_size, 0, sizeof *b->radix);
+    b->radix_size = new_size;
+    return 1;
+}
+
+maskinfo *banlist_match(banlist *b, char *nickname, size_t nickname_size, char *username, size_t username_size, char *hostname, unsigned char *address) {
+    size_t hostname_size = strlen(hostname);
+
+    if (b->radix_size > 0) {
+        size_t r = 0;
+        for (size_t bit = 0; ; bit++) {
+            for (size_t x = b->radix[r].ban; x != 0; x = b->ban[x - 1].next) {
+                if (ban_match(b->ban + x - 1, nickname, nickname_size, username, username_size, hostname, hostname_size)) {
+                    return &b->ban[x - 1].info;
+                }
+            }
+
+            if (bit == sizeof b->ban->address * CHAR_BIT || (r = b->radix[r].next[address[bit / CHAR_BIT] >> (~bit % CHAR_BIT) & 1]) == 0) {
+                break;
+            }
+        }
+    }
+
+    /* Only globs whose literal prefix is a prefix of the field it was taken from, or whose
+     * hostname suffix ends the hostname, can match; for each field and length, those are
+     * found by binary search. */
+    char *field[] = { hostname, nickname, username, hostname };
+    size_t field_size[] = { hostname_size, nickname_size, username_size, hostname_size };
+
+    for (size_t y = 0; y < sizeof field / sizeof *field && b->glob_size > 0; y++) {
+        for (size_t size = 0; size <= field_size[y]; size++) {
+            char *key = y == BAN_SUFFIX ? field[y] + field_size[y] - size : field[y];
+            size_t lo = 0, hi = b->glob_size;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (ban_compare_prefix(b->ban + mid, y, key, size) < 0) {
+                    lo = mid + 1;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+
+            for (; lo < b->glob_size && ban_compare_prefix(b->ban + lo, y, key, size) == 0; lo++) {
+                if (ban_match(b->ban + lo, nickname, nickname_size, username, username_size, hostname, hostname_size)) {
+                    return &b->ban[lo].info;
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+size_t mask_address(char *hostname, size_t size, unsigned char *address) {
+    char host[HOSTLEN + 1];
+    if (size >= sizeof host) {
+        return 0;
+    }
+
+    memcpy(host, hostname, size);
+    host[size] = '\0';
+
+    addrinfo *addr;
+    if (getaddrinfo(host, NULL, &(addrinfo){ .ai_flags = AI_NUMERICHOST,
+                                             .ai_family = AF_UNSPEC }, &addr) != 0) {
+        return 0;
+    }
+
+    size_t bits = mask_sockaddr(addr->ai_addr, address);
+    freeaddrinfo(addr);
+    return bits;
+}
+
+int mask_compare(char *x, size_t x_size, char *y, size_t y_size) {
+    for (size_t z = 0; z < x_size && z < y_size; z++) {
+        int difference = CASEMAPPING_TOLOWER(x[z]) - CASEMAPPING_TOLOWER(y[z]);
+        if (difference != 0) {
+            return difference;
+        }
+    }
+
+    return (x_size > y_size) - (x_size < y_size);
+}
+
+/* Orders as mask_compare does on the reversed strings. */
+int mask_compare_suffix(char *x, size_t x_size, char *y, size_t y_size) {
+    for (size_t z = 1; z <= x_size && z <= y_size; z++) {
+        int difference = CASEMAPPING_TOLOWER(x[x_size - z]) - CASEMAPPING_TOLOWER(y[y_size - z]);
+        if (difference != 0) {
+            return difference;
+        }
+    }
+
+    return (x_size > y_size) - (x_size < y_size);
+}
+
+int mask_match(char *mask, size_t mask_size, char *s, size_t size) {
+    unsigned char *m = (unsigned char *) mask, *t = (unsigned char *) s;
+    size_t x = 0, y = 0, star_x = SIZE_MAX, star_y = 0;
+
+    while (y < size) {
+        if (x < mask_size && m[x] == '*') {
+            star_x = x++;
+            star_y = y;
+        }
+        else if (x < mask_size && (m[x] == '?' || CASEMAPPING_TOLOWER(m[x]) == CASEMAPPING_TOLOWER(t[y]))) {
+            x++;
+            y++;
+        }
+        else if (star_x != SIZE_MAX) {
+            x = star_x + 1;
+            y = ++star_y;
+        }
+        else {
+            return 0;
+        }
+    }
+
+    while (x < mask_size && m[x] == '*') {
+        x++;
+    }
+
+    return x == mask_size;
+}
+
+size_t mask_sockaddr(struct sockaddr *name, unsigned char *address) {
+    if (name->sa_family == AF_INET) {
+        memcpy(address, "\0\0\0\0\0\0\0\0\0\0\xff\xff", 12);
+        memcpy(address + 12, &((struct sockaddr_in *) name)->sin_addr, 4);
+        return 32;
+    }
+
+    if (name->sa_family == AF_INET6) {
+        memcpy(address, &((struct sockaddr_in6 *) name)->sin6_addr, 16);
+        return 128;
+    }
+
+    memset(address, 0, 16);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef INCLUDE_MASK_H
+#define INCLUDE_MASK_H
+
+#include "sock.h"
+
+#include <stddef.h>
+
+#define BAN_SUFFIX 3 /* the field after hostname, nickname and username: the hostname's literal suffix */
+
+typedef struct maskinfo {
+    char *mask;   /* nick!user@host, where host may be an address with a /prefix length */
+    char *reason;
+} maskinfo;
+
+typedef struct ban {
+    maskinfo info;
+    char *nickname, *username, *hostname;
+    size_t nickname_size, username_size, hostname_size;
+    size_t field;        /* which of hostname, nickname and username has the longest literal prefix, or BAN_SUFFIX */
+    char *prefix;        /* that prefix, or suffix compared from its end, by which hostname globs are indexed */
+    size_t prefix_size;
+
+    unsigned int cidr:1; /* hostname is an address, kept in the radix tree */
+    unsigned char address[16];
+    size_t address_size; /* prefix length in bits, IPv4 being mapped into IPv6 */
+    size_t next;         /* index of the next ban at the same radix node plus one, or zero */
+} ban;
+
+typedef struct banlist {
+    size_t size;
+    ban *ban;
+
+    size_t glob_size;   /* bans sort hostname globs first, by field and literal prefix or suffix */
+
+    size_t radix_size;  /* address prefixes, one bit per level over 128-bit addresses */
+    struct {
+        size_t next[2]; /* radix indexes, or zero as the root is nobody's child */
+        size_t ban;     /* index of the first ban ending here plus one, or zero */
+    } *radix;
+} banlist;
+
+extern banlist bans;
+
+int ban_compare(const void *, const void *);
+int ban_compare_prefix(ban *, size_t, char *, size_t);
+int ban_match(ban *, char *, size_t, char *, size_t, char *, size_t);
+
+int banlist_compile(banlist *, maskinfo *);
+int banlist_grow(banlist *);
+maskinfo *banlist_match(banlist *, char *, size_t, char *, size_t, char *, unsigned char *);
+
+size_t mask_address(char *, size_t, unsigned char *);
+int mask_compare(char *, size_t, char *, size_t);
+int mask_compare_suffix(char *, size_t, char *, size_t);
+int mask_match(char *, size_t, char *, size_t);
+size_t mask_sockaddr(struct sockaddr *, unsigned char *);
+#endif
@@ -1,12 +1,12 @@
 #include "node.h"
 
 #include <assert.h>
-#include <ctype.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define debug(statement) (printf("%s:%u entered\n", __FILE__, (unsigned int) __LINE__), statement); printf("%s:%u exited\n", __FILE__, (unsigned int) __LINE__)
@@ -15,28 +15,295 @@ casemap ascii = { "ascii", ascii_tolower };
 casemap strict_rfc1459 = { "strict-rfc1459", strict_rfc1459_tolower };
 casemap rfc1459 = { "rfc1459", rfc1459_tolower };
 
-/* XXX: These need to be changed because IRC guarantees ASCII, where-as C makes no such guarantee.
- *      Reference: http://www.irc.org/tech_docs/005.html */
+/* IRC guarantees ASCII, where C's tolower depends on the locale; these fold by code point.
+ * Reference: http://www.irc.org/tech_docs/005.html */
 
 int ascii_tolower(int c) {
-    return tolower(c);
+    return c >= 'A' && c <= ascii_upper ? c + ('a' - 'A') : c;
 }
 
 int strict_rfc1459_tolower(int c) {
-    const char *punc = "[]\\";
-    return strchr(punc, c) ? "{}|"[strchr(punc, c) - punc] : ascii_tolower(c);
+    return c >= 'A' && c <= strict_rfc1459_upper ? c + ('a' - 'A') : c;
 }
 
 int rfc1459_tolower(int c) {
-    return c == '^' ? '~' : strict_rfc1459_tolower(c);
+    return c >= 'A' && c <= rfc1459_upper ? c + ('a' - 'A') : c;
 }
 
-/* END XXX */
+/* Replays the channel's messages logged after u->history_after, up to u->history_end, oldest first.
+ * The log only links each message to the one before it, so each step walks back from the newest. */
+int channel_history(node *c, node *u) {
+    for (;;) {
+        size_t next = 0, count = 0;
+        for (size_t p = c->history_last; p > u->history_after && count < HISTORYLEN; count++) {
+            historyentry *e = historylog_entry(&history, p);
+            if (e == NULL) {
+                break;
+            }
+
+            if (p <= u->history_end && !e->quiet) {
+                next = p;
+            }
+
+            p = e->previous;
+        }
+
+        if (next == 0) {
+            return 1;
+        }
+
+        if (u->source.node && u->source.node != u) {
+            return 0;
+        }
+
+        u->source.node = u;
+
+        historyentry *e = historylog_entry(&history, next);
+        size_t tags = u->tagdata ? 0 : e->tags;
+        int n = user_send(u, (char *) (e + 1) + tags, e->size - tags);
+        if (n == 0) {
+            return 0;
+        }
+
+        u->source.node = NULL;
+        if (n < 0) {
+            return n;
+        }
+
+        u->history_after = next;
+    }
+}
 
+/* Delivers the channel's logged lines to its members, each member's in order from where it left off.
+ * A member busy sending something else is passed over and caught up by a later pass, so one slow
+ * member doesn't hold up the rest. A channel's quantum counts lines sent; when it runs out the channel
+ * goes on the run queue like any node, so one large channel takes turns with the others. */
 int channel_info(node *c, nodeinfo **list) {
+    c->run.quantum = FANOUT;
+
+    for (;;) {
+        if (c->fanout == 0) {
+            if (c->fanout_done == c->history_last) {
+                return 0;
+            }
+
+            c->fanout = c->history_last;
+            c->fanout_behind = 0;
+        }
+
+        int n = channel_send(c, list);
+        if (n <= 0) {
+            return n;
+        }
+
+        /* Repeat a pass that left members behind on the next turn rather than spinning on them now. */
+        if (c->fanout_behind) {
+            c->fanout = 0;
+            return 0;
+        }
+
+        c->fanout_done = c->fanout;
+        c->fanout = 0;
+    }
+}
+
+int channel_join(nodeinfo **list, node *c, node *u) {
+    size_t c_index = c - (*list)->node, u_index = u - (*list)->node, x = 0;
+
+    node *b = u->first_channel.node;
+    for (; b != NULL; b = b->next_channel.node) {
+        for (x = 0; x < (sizeof *b - offsetof(node, channel)) / sizeof *(b->channel) && b->channel[x].node != NULL; x++);
+        if (x < (sizeof *b - offsetof(node, channel)) / sizeof *(b->channel)) {
+            break;
+        }
+    }
+
+    if (b == NULL) {
+        b = nodeinfo_add(list, &(node){ .evaluate = user_channel });
+        if (b == NULL) {
+            return 0;
+        }
+
+        c = (*list)->node + c_index;
+        u = (*list)->node + u_index;
+        b->next_channel.node = u->first_channel.node;
+        u->first_channel.node = b;
+        x = 0;
+    }
+
+    b->channel[x].node = c;
+
+    node *d = c->first_user.node;
+    for (; d != NULL; d = d->next_user.node) {
+        for (x = 0; x < (sizeof *d - offsetof(node, user)) / sizeof *(d->user) && d->user[x].node != NULL; x++);
+        if (x < (sizeof *d - offsetof(node, user)) / sizeof *(d->user)) {
+            break;
+        }
+    }
+
+    if (d == NULL) {
+        d = nodeinfo_add(list, &(node){ .evaluate = channel_user });
+        if (d == NULL) {
+            return 0;
+        }
+
+        c = (*list)->node + c_index;
+        u = (*list)->node + u_index;
+        d->next_user.node = c->first_user.node;
+        c->first_user.node = d;
+        x = 0;
+    }
+
+    d->user[x].node = u;
+    d->user[x].delivered = c->history_last;
+    c->users++;
+    return 1;
+}
+
+int channel_member(node *c, node *u) {
+    for (node *b = u->first_channel.node; b != NULL; b = b->next_channel.node) {
+        for (size_t x = 0; x < (sizeof *b - offsetof(node, channel)) / sizeof *(b->channel); x++) {
+            if (b->channel[x].node == c) {
+                return 1;
+            }
+        }
+    }
+
     return 0;
 }
 
+/* The log position plus one of the last line delivered to u as a member of c, or zero. */
+size_t channel_delivered(node *c, node *u) {
+    for (node *d = c->first_user.node; d != NULL; d = d->next_user.node) {
+        for (size_t x = 0; x < (sizeof *d - offsetof(node, user)) / sizeof *(d->user); x++) {
+            if (d->user[x].node == u) {
+                return d->user[x].delivered;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* The log position plus one of the line to deliver to a member after the one at delivered, up to
+ * c->fanout, or zero when the member has fallen so far behind that the line is overwritten or more
+ * than HISTORYLEN lines back. A member that joined before the channel logged anything starts from
+ * its first line. */
+size_t channel_next_line(node *c, size_t delivered) {
+    historyentry *last = historylog_entry(&history, c->fanout);
+    if (last == NULL) {
+        return 0;
+    }
+
+    if (delivered != 0) {
+        historyentry *e = historylog_entry(&history, delivered);
+        return e != NULL && e->next != 0 && last->sequence - e->sequence <= HISTORYLEN ? e->next : 0;
+    }
+
+    size_t p = c->fanout;
+    for (size_t count = 1; count < HISTORYLEN; count++) {
+        historyentry *f = historylog_entry(&history, p);
+        if (f->previous == 0) {
+            return p;
+        }
+
+        if (historylog_entry(&history, f->previous) == NULL) {
+            return 0;
+        }
+
+        p = f->previous;
+    }
+
+    return historylog_entry(&history, p)->previous == 0 ? p : 0;
+}
+
+/* Finds the first member at or after the cursor given by block, the index of a channel_user node
+ * plus one or zero for the first, and slot, and moves the cursor onto it. New blocks go in front,
+ * and one freed under the cursor forwards it to the block that followed, so a cursor stays valid as
+ * members come and go; one left from a channel that has since gone starts over. */
+node *channel_next_user(nodeinfo **list, node *c, size_t *block, size_t *slot) {
+    size_t x = *slot;
+    node *d = *block ? (*list)->node + *block - 1 : c->first_user.node;
+    while (d != NULL && d->evaluate != channel_user) {
+        d = d->source.node == c ? d->target.node : c->first_user.node;
+        x = 0;
+    }
+
+    for (; d != NULL; d = d->next_user.node, x = 0) {
+        for (; x < (sizeof *d - offsetof(node, user)) / sizeof *(d->user); x++) {
+            if (d->user[x].node != NULL) {
+                *block = d - (*list)->node + 1;
+                *slot = x;
+                return d->user[x].node;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Removes u from c, freeing whichever of their blocks that empties, and c itself along with its
+ * name once it has no members. A freed channel_user block is left naming c as its source and the
+ * block that followed it as its target, for channel_next_user. */
+void channel_part(nodeinfo **list, node *c, node *u) {
+    for (node **ref = &u->first_channel.node, *b; (b = *ref) != NULL; ref = &b->next_channel.node) {
+        size_t found = 0, used = 0;
+        for (size_t x = 0; x < (sizeof *b - offsetof(node, channel)) / sizeof *(b->channel); x++) {
+            if (b->channel[x].node == c) {
+                b->channel[x].node = NULL;
+                found = 1;
+            }
+
+            used += b->channel[x].node != NULL;
+        }
+
+        if (found) {
+            if (used == 0) {
+                *ref = b->next_channel.node;
+                nodeinfo_free(list, b);
+            }
+
+            break;
+        }
+    }
+
+    for (node **ref = &c->first_user.node, *d; (d = *ref) != NULL; ref = &d->next_user.node) {
+        size_t found = 0, used = 0;
+        for (size_t x = 0; x < (sizeof *d - offsetof(node, user)) / sizeof *(d->user); x++) {
+            if (d->user[x].node == u) {
+                d->user[x].node = NULL;
+                c->users--;
+                found = 1;
+            }
+
+            used += d->user[x].node != NULL;
+        }
+
+        if (found) {
+            if (used == 0) {
+                node *next = d->next_user.node;
+                *ref = next;
+
+                /* The pass over the members in progress carries on from the next block. */
+                if (c->target.node == d) {
+                    c->target.node = next;
+                }
+
+                nodeinfo_free(list, d);
+                d->source.node = c;
+                d->target.node = next;
+            }
+
+            break;
+        }
+    }
+
+    if (c->users == 0) {
+        nodeinfo_remove(list, c);
+        nodeinfo_free(list, c);
+    }
+}
+
 int channel_user(node *c, nodeinfo **list) {
     return 0;
 }
@@ -44,11 +311,27 @@ int channel_user(node *c, nodeinfo **list) {
 size_t node_bit(void *u, size_t offset, size_t size) {
     unsigned char *u_nickname = u;
     size_t hi = offset / CHAR_BIT;
-    return hi < size && (CASEMAPPING.tolower(u_nickname[hi]) >> (~offset % CHAR_BIT)) % 2;
+    return hi < size && (CASEMAPPING_TOLOWER(u_nickname[hi]) >> (~offset % CHAR_BIT)) % 2;
 }
 
 int node_cleanup(node *u, nodeinfo **list) {
-    assert(0);
+    if (u->nickname[0] != '\0') {
+        nodeinfo_remove(list, u);
+    }
+
+    for (node *c; (c = user_next_channel(list, u, &(size_t){ 0 }, &(size_t){ 0 })) != NULL;) {
+        channel_part(list, c, u);
+    }
+
+    if (u->capture) {
+        capturelog_append(&capture, CAPTURE_CLOSE, u->capture, NULL, 0);
+    }
+
+    user_broadcast_end(u, list);
+    free(u->tagdata);
+    free(u->keptdata);
+    closesocket(u->fd);
+    nodeinfo_free(list, u);
     return 0;
 }
 
@@ -57,7 +340,12 @@ size_t node_compare(void *x, void *y, size_t offset, size_t size) {
                   *y_nickname = y;
     size_t hi = offset / CHAR_BIT;
 
-    while (hi < size && CASEMAPPING.tolower(x_nickname[hi]) == CASEMAPPING.tolower(y_nickname[hi])) {
+    /* Skip the common prefix a word at a time, then find the differing byte. */
+    while (hi + sizeof (uint64_t) <= size && node_fold(x_nickname + hi) == node_fold(y_nickname + hi)) {
+        hi += sizeof (uint64_t);
+    }
+
+    while (hi < size && CASEMAPPING_TOLOWER(x_nickname[hi]) == CASEMAPPING_TOLOWER(y_nickname[hi])) {
         hi++;
     }
 
@@ -65,7 +353,7 @@ size_t node_compare(void *x, void *y, size_t offset, size_t size) {
               ? ~0U % CHAR_BIT
               : ~offset % CHAR_BIT,
            sum = hi < size
-               ? CASEMAPPING.tolower(x_nickname[hi]) ^ CASEMAPPING.tolower(y_nickname[hi])
+               ? (size_t) (CASEMAPPING_TOLOWER(x_nickname[hi]) ^ CASEMAPPING_TOLOWER(y_nickname[hi]))
                : ~0U % UCHAR_MAX;
 
     while (lo > 0 && sum >> lo == 0) {
@@ -75,115 +363,149 @@ size_t node_compare(void *x, void *y, size_t offset, size_t size) {
     return hi * CHAR_BIT + ~lo % CHAR_BIT;
 }
 
-node *nodeinfo_add(nodeinfo **list, node *u) {
-    size_t old_size = *list ? (*list)->size : 0, new_size = old_size + 1;
-    assert(new_size > old_size);
+/* Calls e for the nodes below n whose nicknames match mask and sort after the nickname
+ * given by after, in order, stopping early when e returns 0 or less. Each nickname is
+ * reached by exactly one upward link; a link to the side its own bit doesn't select is
+ * the unused link of the leaf beyond the last bit and is skipped. Only the sides along
+ * after's search path are descended with after as the bound; the sides off it sort
+ * wholly before after, and are skipped, or wholly after it, and need no bound. */
+int node_enumerate(node *n, char *mask, size_t mask_size, void *after, size_t split, node *u, nodeinfo **list, enumerator *e) {
+    for (size_t bit = 0; bit < 2; bit++) {
+        int side = node_enumerate_side(n, bit, after, split);
+        if (side < 0) {
+            continue;
+        }
 
-    if ((old_size & new_size) == 0) {
-        int tree_formed = old_size && (*list)->root.node;
-        node *l = tree_formed ? (*list)->node : NULL;
+        void *bound = side == 0 ? after : NULL;
+        node *next = n->next.node[bit];
+        int r = next->offset > n->offset ? node_enumerate(next, mask, mask_size, bound, split, u, list, e)
+              : node_bit(next, n->offset, NICKLEN) == bit ? node_enumerate_match(next, mask, mask_size, bound, u, list, e)
+              : 1;
+        if (r <= 0) {
+            return r;
+        }
+    }
 
-        if (SIZE_MAX / 2 / sizeof *u <= new_size) { return NULL; }
+    return 1;
+}
 
-        if (tree_formed) {
-            (*list)->root.offset = (*list)->root.node - (*list)->node;
-            for (size_t x = 0; x < old_size; x++) {
-                node *n = l + x;
+int node_enumerate_match(node *v, char *mask, size_t mask_size, void *after, node *u, nodeinfo **list, enumerator *e) {
+    if (after != NULL) {
+        size_t offset = node_compare(v, after, 0, NICKLEN);
+        if (offset / CHAR_BIT == NICKLEN || node_bit(v, offset, NICKLEN) == 0) {
+            return 1;
+        }
+    }
 
-                size_t next[2] = { n->next.node[0] ? n->next.node[0] - l : 0,
-                                   n->next.node[1] ? n->next.node[1] - l : 0 };
-                n->next.offset[0] = next[0];
-                n->next.offset[1] = next[1];
+    return node_match(v, mask, mask_size) ? e(u, list, v) : 1;
+}
 
-                if (n->evaluate == channel_user) {
-                    n->next_user.offset = n->next_user.node ? n->next_user.node - l : 0;
+/* Where the side bit of n, a node on the search path of after, sorts against after, given
+ * split, the first bit at which after differs from the nickname its search ends at: below
+ * 0 wholly before it, 0 along its search path, or above 0 wholly after it. The nicknames
+ * below n all agree with that one before n's offset, so past split they all differ from
+ * after as it does; before split, they agree with after up to n's offset, and a side is
+ * ordered against after by its bit. Without after, everything sorts after it. */
+int node_enumerate_side(node *n, size_t bit, void *after, size_t split) {
+    if (after == NULL) {
+        return 1;
+    }
 
-                    for (size_t x = 0; x < (sizeof *n - offsetof(node, user)) / sizeof *(n->user); x++) {
-                        n->user[x].offset = n->user[x].node ? n->user[x].node - l : 0;
-                    }
+    if (n->offset > split) {
+        return node_bit(after, split, NICKLEN) ? -1 : 1;
+    }
 
-                    continue;
-                }
+    size_t after_bit = node_bit(after, n->offset, NICKLEN);
+    return (bit > after_bit) - (bit < after_bit);
+}
 
-                if (n->evaluate == user_channel) {
-                    n->next_channel.offset = n->next_channel.node ? n->next_channel.node - l : 0;
+/* Folds the eight bytes at data to lowercase at once: bytes below 0x80 gain their high bit from the
+ * additions exactly when they are at least 'A' and again when past the casemapping's last uppercase
+ * character, and no addition can carry into the next byte. */
+uint64_t node_fold(void *data) {
+    uint64_t word, ones = UINT64_C(0x0101010101010101), high = ones << 7;
+    memcpy(&word, data, sizeof word);
 
-                    for (size_t x = 0; x < (sizeof *n - offsetof(node, channel)) / sizeof *(n->channel); x++) {
-                        n->channel[x].offset = n->channel[x].node ? n->channel[x].node - l : 0;
-                    }
+    uint64_t low = word & ~high,
+             upper = (low + ones * (0x80 - 'A')) & ~(low + ones * (0x7F - CASEMAPPING_UPPER)) & ~word & high;
+    return word | upper >> 2;
+}
 
-                    continue;
-                }
+/* Whether u keeps other nodes' indexes across turns, so that nodes freed meanwhile can't be reused
+ * yet: a user part way through receiving a line from its source, a user relaying to the targets it
+ * looked up, or a user with a cursor over a channel's members. A channel's lines name the member they
+ * skip, but a node reusing that index joins after them, so it is never delivered them. */
+int node_holds(node *u) {
+    if (u->evaluate == channel_info || u->evaluate == channel_user || u->evaluate == user_channel || u->evaluate == node_unused) {
+        return 0;
+    }
 
-                size_t source = n->source.node ? n->source.node - l : 0;
-                size_t target = n->target.node ? n->target.node - l : 0;
+    return u->source.node != NULL || u->evaluate == user_participation_relay_message || u->query_block != 0 || u->broadcast != 0;
+}
 
-                n->source.offset = source;
-                n->target.offset = target;
+int node_match(void *u, char *mask, size_t mask_size) {
+    char *end = memchr(u, '\0', NICKLEN);
+    return mask_match(mask, mask_size, u, end ? (size_t) (end - (char *) u) : NICKLEN);
+}
 
-                if (n->evaluate == channel_info) {
-                    n->first_user.offset = n->first_user.node ? n->first_user.node - l : 0;
-                    continue;
-                }
+/* A freed node waiting to be reused; there is nothing to evaluate. */
+int node_unused(node *u, nodeinfo **list) {
+    (void) u;
+    (void) list;
+    return 0;
+}
 
-                n->first_channel.offset = n->first_channel.node ? n->first_channel.node - l : 0;
-            }
+node *nodeinfo_add(nodeinfo **list, node *u) {
+    /* The oldest unused node goes first, once no node can still hold its index and it is off the run queue. */
+    node *v = *list && (*list)->first_free ? (*list)->node + (*list)->first_free - 1 : NULL;
+    if (v != NULL && v->free.pass < (*list)->quiescent && !v->run.queued) {
+        (*list)->first_free = v->free.next;
+        if ((*list)->first_free == 0) {
+            (*list)->last_free = 0;
+        }
+
+        *v = *u;
+        v->next.node[0] = v;
+        v->next.node[1] = v;
+        return v;
+    }
+
+    size_t old_size = *list ? (*list)->size : 0, new_size = old_size + 1;
+    assert(new_size > old_size);
+
+    if ((old_size & new_size) == 0) {
+        if (SIZE_MAX / 2 / sizeof *u <= new_size) { return NULL; }
+
+        if (old_size) {
+            nodeinfo_freeze(*list);
         }
 
         size_t new_capacity = new_size * 2 * sizeof *u;
         assert(new_capacity > new_size);
 
-        void *temp = realloc(*list, sizeof *list + new_capacity);
-        if (temp == NULL) { return NULL; }
+        void *temp = realloc(*list, sizeof **list + new_capacity);
+        if (temp == NULL) {
+            if (old_size) {
+                nodeinfo_thaw(*list);
+            }
+
+            return NULL;
+        }
 
         *list = temp;
-        if (!tree_formed) {
+        if (old_size == 0) {
             (*list)->root.node = NULL;
+            (*list)->epoch = 0;
+            memset((*list)->broadcast, 0, sizeof (*list)->broadcast);
+            (*list)->first_link = 0;
+            (*list)->pass = 1;
+            (*list)->quiescent = 0;
+            (*list)->first_free = 0;
+            (*list)->last_free = 0;
+            memset(&(*list)->runqueue, 0, sizeof (*list)->runqueue);
         }
         else {
-            l = (*list)->node;
-            (*list)->root.node = (*list)->node + (*list)->root.offset;
-            for (size_t x = 0; x < old_size; x++) {
-                node *n = l + x;
-
-                node *next[2] = { n->next.offset[0] ? l + n->next.offset[0] : NULL,
-                                  n->next.offset[1] ? l + n->next.offset[1] : NULL };
-                n->next.node[0] = next[0];
-                n->next.node[1] = next[1];
-
-                if (n->evaluate == channel_user) {
-                    n->next_user.node = n->next_user.offset ? l + n->next_user.offset : NULL;
-
-                    for (size_t x = 0; x < (sizeof *n - offsetof(node, user)) / sizeof *(n->user); x++) {
-                        n->user[x].node = n->user[x].offset ? l + n->user[x].offset : NULL;
-                    }
-
-                    continue;
-                }
-
-                if (n->evaluate == user_channel) {
-                    n->next_channel.node = n->next_channel.offset ? l + n->next_channel.offset : NULL;
-
-                    for (size_t x = 0; x < (sizeof *n - offsetof(node, channel)) / sizeof *(n->channel); x++) {
-                        n->channel[x].node = n->channel[x].offset ? l + n->channel[x].offset : NULL;
-                    }
-
-                    continue;
-                }
-
-                node *source = n->source.offset ? l + n->source.offset : NULL;
-                node *target = n->target.offset ? l + n->target.offset : NULL;
-
-                n->source.node = source;
-                n->target.node = target;
-
-                if (n->evaluate == channel_info) {
-                    n->first_user.node = n->first_user.offset ? l + n->first_user.offset : NULL;
-                    continue;
-                }
-
-                n->first_channel.node = n->first_channel.offset ? l + n->first_channel.offset : NULL;
-            }
+            nodeinfo_thaw(*list);
         }
     }
 
@@ -214,124 +536,244 @@ void nodeinfo_bind(nodeinfo **list, addrinfo *addr, evaluator *e) {
     }
 }
 
-node *nodeinfo_get(nodeinfo **list, void *u, size_t size) {
-    node *n = *nodeinfo_getref(list, u, size);
-
-    return n != NULL && node_compare(n, u, 0, size) / CHAR_BIT == size ? n : NULL;
+/* Microseconds on a monotonic clock, which carries on across a restart; clock() counts only the
+ * CPU time spent meanwhile, and none of the time a node waits while the server sleeps. */
+unsigned long long nodeinfo_clock(void) {
+#   ifdef WIN32
+    return GetTickCount() * 1000ULL;
+#   else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+#   endif
 }
 
-node **nodeinfo_getref(nodeinfo **list, void *u, size_t size) {
-    size_t offset;
-    node **n = &(*list)->root.node;
+node *nodeinfo_connect(nodeinfo **list, addrinfo *addr) {
+    while (addr != NULL) {
+        sockfd fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
 
-    if (*n == NULL) {
-        return n;
-    }
+        if (sock_invalid(fd)) {
+            addr = addr->ai_next;
+            continue;
+        }
 
-    do {
-        offset = (*n)->offset;
-        n = (*n)->next.node + node_bit(u, offset, size);
-    } while (offset < (*n)->offset);
+        node *l;
+        if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0 && set_nonblock(fd) && (l = nodeinfo_link(list, fd)) != NULL) {
+            return l;
+        }
 
-    return n;
-}
+        closesocket(fd);
+        addr = addr->ai_next;
+    }
 
-int evaluatorinfo_compare(const void *x, const void *y) {
-    return strcmp(((const evaluatorinfo *) x)->name, ((const evaluatorinfo *) y)->name);
+    return NULL;
 }
 
-int server_accept(node *u, nodeinfo **list) {
-    size_t count = 0;
-    sockfd fd = accept(u->fd);
+size_t nodeinfo_drain(nodeinfo **list) {
+    for (size_t size = (*list)->runqueue.size; size > 0 && (*list)->runqueue.first; size--) {
+        size_t x = (*list)->runqueue.first - 1;
+        node *u = (*list)->node + x;
 
-    if (sock_invalid(fd)) {
-        return 0;
-    }
+        (*list)->runqueue.first = u->run.next;
+        if ((*list)->runqueue.first == 0) {
+            (*list)->runqueue.last = 0;
+        }
 
-    if (!set_nonblock(fd) || !nodeinfo_add(list, &(node){ .fd = fd,
-                                                          .evaluate = user_registration })) {
-        closesocket(fd);
-    }
+        (*list)->runqueue.size--;
+        u->run.next = 0;
+        u->run.queued = 0;
 
-    return 0;
-}
+        unsigned long long delay = nodeinfo_clock() - u->run.time;
+        (*list)->runqueue.count++;
+        (*list)->runqueue.delay += delay;
+        if (delay > (*list)->runqueue.delay_max) {
+            (*list)->runqueue.delay_max = delay;
+        }
 
-int user_channel(node *u, nodeinfo **list) {
-    return 0;
-}
+        nodeinfo_run(list, x);
+    }
 
-int user_discard(node *u) {
-    u->recvdata_past = u->recvdata[u->recvdata_mark++];
-    u->recvdata_size -= u->recvdata_mark;
-    memmove(u->recvdata, u->recvdata + u->recvdata_mark, u->recvdata_size);
-    u->recvdata_mark = 0;
-    return u->recvdata_past;
+    return (*list)->runqueue.size;
 }
 
-int user_discard_line(node *u) {
-    int n = user_recv(u);
-    if (n <= 0) {
-        return n;
+void nodeinfo_enqueue(nodeinfo **list, node *u) {
+    if (u->run.queued) {
+        return;
     }
-    return user_discard(u) != ' ';
-}
 
-int user_error(node *u, nodeinfo **list, evaluator *e, char *format) {
-    int n = sendf(u, format, HOSTNAME, NICKLEN, u->nickname[0] == '\0' ? "*" : u->nickname, u->recvdata_mark, u->recvdata);
-    if (n <= 0) {
-        return n;
+    size_t x = u - (*list)->node + 1;
+    if ((*list)->runqueue.last) {
+        (*list)->node[(*list)->runqueue.last - 1].run.next = x;
+    }
+    else {
+        (*list)->runqueue.first = x;
     }
 
-    u->evaluate = e;
-    return u->evaluate(u, list);
+    (*list)->runqueue.last = x;
+    (*list)->runqueue.size++;
+    u->run.next = 0;
+    u->run.queued = 1;
+    u->run.time = nodeinfo_clock();
 }
 
-int user_evaluate(node *u, nodeinfo **list, evaluatorinfo *e, size_t e_size, evaluator *not_enough_parameters, evaluator *unknown_command) {
-    int n = user_recv(u);
-    if (n <= 0) {
-        return n;
+int nodeinfo_enumerate(nodeinfo **list, char *mask, size_t mask_size, void *after, node *u, enumerator *e) {
+    size_t prefix_size = 0;
+    while (prefix_size < mask_size && mask[prefix_size] != '*' && mask[prefix_size] != '?') {
+        prefix_size++;
     }
 
-    if (u->recvdata[u->recvdata_mark] != ' ') {
-        u->evaluate = not_enough_parameters;
-        return u->evaluate(u, list);
+    node *n = (*list)->root.node;
+    if (n == NULL) {
+        return 1;
     }
 
-    u->recvdata[u->recvdata_mark] = '\0';
-    e = bsearch(&(evaluatorinfo){ .name = u->recvdata }, e, e_size, sizeof *e, evaluatorinfo_compare);
-    u->recvdata[u->recvdata_mark] = ' ';
-
-    if (e == NULL) {
-        u->evaluate = unknown_command;
-        return u->evaluate(u, list);
-    }
+    /* Resuming after a nickname only visits the sides at or beyond its search path, so a
+     * long listing costs the trie's depth per turn rather than every nickname before it. */
+    size_t split = node_compare(*nodeinfo_getref(list, after, NICKLEN), after, 0, NICKLEN);
 
-    u->evaluate = e->evaluate;
-    user_discard(u);
-    return u->evaluate(u, list);
+    /* Only the subtree selected by the literal prefix can hold matches. */
+    while (n->offset < prefix_size * CHAR_BIT) {
+        size_t bit = node_bit(mask, n->offset, prefix_size);
+        int side = node_enumerate_side(n, bit, after, split);
+        if (side < 0) {
+            return 1;
+        }
+
+        if (side > 0) {
+            after = NULL;
+        }
+
+        node *next = n->next.node[bit];
+        if (next->offset <= n->offset) {
+            return node_enumerate_match(next, mask, mask_size, after, u, list, e);
+        }
+
+        n = next;
+    }
+
+    return node_enumerate(n, mask, mask_size, after, split, u, list, e);
 }
 
-int user_nickname(node *u, nodeinfo **list, evaluator *nickname_success, evaluator *nickname_in_use) {
-    int n = user_recv(u);
-    if (n <= 0) {
+/* Marks u unused and queues it for reuse; it keeps its place on the run queue until dequeued. */
+void nodeinfo_free(nodeinfo **list, node *u) {
+    size_t x = u - (*list)->node + 1;
+    *u = (node) { .evaluate = node_unused,
+                  .run = u->run,
+                  .free.pass = (*list)->pass };
+
+    if ((*list)->last_free) {
+        (*list)->node[(*list)->last_free - 1].free.next = x;
+    }
+    else {
+        (*list)->first_free = x;
+    }
+
+    (*list)->last_free = x;
+}
+
+void nodeinfo_freeze(nodeinfo *list) {
+    node *l = list->node;
+
+    list->root.offset = list->root.node ? list->root.node - l : 0;
+    for (size_t x = 0; x < list->size; x++) {
+        node *n = l + x;
+
+        size_t next[2] = { n->next.node[0] ? n->next.node[0] - l : 0,
+                           n->next.node[1] ? n->next.node[1] - l : 0 };
+        n->next.offset[0] = next[0];
+        n->next.offset[1] = next[1];
+
+        if (n->evaluate == channel_user) {
+            n->next_user.offset = n->next_user.node ? n->next_user.node - l : 0;
+
+            for (size_t x = 0; x < (sizeof *n - offsetof(node, user)) / sizeof *(n->user); x++) {
+                n->user[x].offset = n->user[x].node ? n->user[x].node - l : 0;
+            }
+
+            continue;
+        }
+
+        if (n->evaluate == user_channel) {
+            n->next_channel.offset = n->next_channel.node ? n->next_channel.node - l : 0;
+
+            for (size_t x = 0; x < (sizeof *n - offsetof(node, channel)) / sizeof *(n->channel); x++) {
+                n->channel[x].offset = n->channel[x].node ? n->channel[x].node - l : 0;
+            }
+
+            continue;
+        }
+
+        size_t source = n->source.node ? n->source.node - l : 0;
+        size_t target = n->target.node ? n->target.node - l : 0;
+
+        n->source.offset = source;
+        n->target.offset = target;
+
+        if (n->evaluate == channel_info) {
+            n->first_user.offset = n->first_user.node ? n->first_user.node - l : 0;
+            continue;
+        }
+
+        n->first_channel.offset = n->first_channel.node ? n->first_channel.node - l : 0;
+    }
+}
+
+/* Nicknames are stored padded with '\0' to NICKLEN, and compared over all of it, so a name
+ * shorter than a stored one doesn't match it as a prefix. Longer names are cut at NICKLEN. */
+node *nodeinfo_get(nodeinfo **list, void *u, size_t size) {
+    char name[NICKLEN] = { 0 };
+    memcpy(name, u, size < NICKLEN ? size : NICKLEN);
+
+    node *n = *nodeinfo_getref(list, name, NICKLEN);
+    return n != NULL && node_compare(n, name, 0, NICKLEN) / CHAR_BIT == NICKLEN ? n : NULL;
+}
+
+size_t nodeinfo_getv(nodeinfo **list, char *names, size_t size, size_t *index, size_t count) {
+    char *name = names, *end = names + size;
+    size_t x = 0;
+
+    while (x < count) {
+        char *comma = memchr(name, ',', end - name);
+        node *n = nodeinfo_get(list, name, (comma ? comma : end) - name);
+        index[x++] = n ? n - (*list)->node + 1 : 0;
+
+        if (comma == NULL) {
+            break;
+        }
+
+        name = comma + 1;
+    }
+
+    return x;
+}
+
+node **nodeinfo_getref(nodeinfo **list, void *u, size_t size) {
+    size_t offset;
+    node **n = &(*list)->root.node;
+
+    if (*n == NULL) {
         return n;
     }
 
-    node *v = nodeinfo_get(list, u->recvdata, u->recvdata_mark);
-    u->evaluate = v && v != u
-                ? nickname_in_use
-                : nickname_success;
-    return u->evaluate(u, list);
+    do {
+        offset = (*n)->offset;
+        n = (*n)->next.node + node_bit(u, offset, size);
+    } while (offset < (*n)->offset);
+
+    return n;
 }
 
-int user_nickname_success(node *u, nodeinfo **list, evaluator *e) {
-    size_t nickname_size = u->recvdata_mark < NICKLEN ? u->recvdata_mark : NICKLEN;
+void nodeinfo_insert(nodeinfo **list, node *u) {
     size_t child_offset, parent_offset = 0;
     node *root = (*list)->root.node ? (*list)->root.node : u, **branch = &root;
 
-    u->evaluate = e;
-    memmove(u->nickname, u->recvdata, nickname_size);
-    memset(u->nickname + nickname_size, 0, NICKLEN - nickname_size);
+    if ((*list)->root.node == NULL) {
+        u->offset = node_compare(u, u, 0, NICKLEN);
+        u->next.node[0] = u;
+        u->next.node[1] = u;
+        (*list)->root.node = u;
+        return;
+    }
 
     do {
         child_offset = node_compare(*branch, u, parent_offset, NICKLEN);
@@ -357,144 +799,2069 @@ int user_nickname_success(node *u, nodeinfo **list, evaluator *e) {
 
     *branch = u;
     (*list)->root.node = root;
+}
+
+/* Lists the offset and size of every field of nodeinfo and node, and the bit of each one-bit
+ * field, into layout, which holds NODEINFO_LAYOUT entries, and returns how many it took. A
+ * snapshot is only loaded by a binary listing the same; the sizes of the structures alone
+ * miss fields that were reordered or retyped. */
+size_t nodeinfo_layout(size_t *layout) {
+    size_t x = 0;
+    node n;
+
+#   define NODEINFO_FIELD(type, field) (layout[x++] = offsetof(type, field), layout[x++] = sizeof ((type *) NULL)->field)
+#   define NODEINFO_BIT(field)         (memset(&n, 0, sizeof n), n.field = 1, layout[x++] = nodeinfo_layout_bit(&n))
+    layout[x++] = sizeof (nodeinfo);
+    layout[x++] = sizeof (node);
+
+    NODEINFO_FIELD(nodeinfo, size);
+    NODEINFO_FIELD(nodeinfo, root);
+    NODEINFO_FIELD(nodeinfo, epoch);
+    NODEINFO_FIELD(nodeinfo, broadcast);
+    NODEINFO_FIELD(nodeinfo, first_link);
+    NODEINFO_FIELD(nodeinfo, pass);
+    NODEINFO_FIELD(nodeinfo, quiescent);
+    NODEINFO_FIELD(nodeinfo, first_free);
+    NODEINFO_FIELD(nodeinfo, last_free);
+    NODEINFO_FIELD(nodeinfo, runqueue.first);
+    NODEINFO_FIELD(nodeinfo, runqueue.last);
+    NODEINFO_FIELD(nodeinfo, runqueue.size);
+    NODEINFO_FIELD(nodeinfo, runqueue.count);
+    NODEINFO_FIELD(nodeinfo, runqueue.delay);
+    NODEINFO_FIELD(nodeinfo, runqueue.delay_max);
+    NODEINFO_FIELD(nodeinfo, node[0]);
+
+    NODEINFO_FIELD(node, nickname);
+    NODEINFO_FIELD(node, offset);
+    NODEINFO_FIELD(node, evaluate);
+    NODEINFO_FIELD(node, source);
+    NODEINFO_FIELD(node, target);
+    NODEINFO_FIELD(node, next);
+    NODEINFO_FIELD(node, epoch);
+    NODEINFO_FIELD(node, run.quantum);
+    NODEINFO_FIELD(node, run.next);
+    NODEINFO_BIT(run.queued);
+    NODEINFO_FIELD(node, run.time);
+    NODEINFO_FIELD(node, free.next);
+    NODEINFO_FIELD(node, free.pass);
+    NODEINFO_FIELD(node, hold);
+
+    NODEINFO_FIELD(node, fd);
+    NODEINFO_FIELD(node, first_channel);
+    NODEINFO_FIELD(node, recvdata_mark);
+    NODEINFO_FIELD(node, recvdata_size);
+    NODEINFO_FIELD(node, recvdata_past);
+    NODEINFO_FIELD(node, senddata_size);
+    NODEINFO_FIELD(node, keptdata);
+    NODEINFO_FIELD(node, keptdata_size);
+    NODEINFO_FIELD(node, tagdata);
+    NODEINFO_FIELD(node, tagdata_size);
+    NODEINFO_FIELD(node, broadcast);
+    NODEINFO_FIELD(node, broadcast_id);
+    NODEINFO_FIELD(node, broadcast_block);
+    NODEINFO_FIELD(node, broadcast_slot);
+    NODEINFO_FIELD(node, broadcast_user_block);
+    NODEINFO_FIELD(node, broadcast_user_slot);
+    NODEINFO_BIT(registered);
+    NODEINFO_FIELD(node, capture);
+    NODEINFO_BIT(negotiating);
+    NODEINFO_BIT(collided);
+    NODEINFO_BIT(sendq_exceeded);
+    NODEINFO_FIELD(node, link);
+    NODEINFO_FIELD(node, next_link);
+    NODEINFO_FIELD(node, burst);
+    NODEINFO_FIELD(node, burst_time);
+    NODEINFO_FIELD(node, linkdata);
+    NODEINFO_FIELD(node, linkdata_size);
+    NODEINFO_FIELD(node, linkdata_capacity);
+    NODEINFO_FIELD(node, target_size);
+    NODEINFO_FIELD(node, target_sent);
+    NODEINFO_FIELD(node, target_index);
+    NODEINFO_FIELD(node, header_size);
+    NODEINFO_FIELD(node, header);
+    NODEINFO_FIELD(node, query);
+    NODEINFO_FIELD(node, query_block);
+    NODEINFO_FIELD(node, query_slot);
+    NODEINFO_FIELD(node, history_channel);
+    NODEINFO_FIELD(node, history_since);
+    NODEINFO_FIELD(node, history_after);
+    NODEINFO_FIELD(node, history_end);
+    NODEINFO_FIELD(node, history_part);
+    NODEINFO_FIELD(node, recvdata);
+    NODEINFO_FIELD(node, username);
+    NODEINFO_FIELD(node, hostname);
+    NODEINFO_FIELD(node, address);
+    NODEINFO_FIELD(node, ban);
+
+    NODEINFO_FIELD(node, topic);
+    NODEINFO_FIELD(node, key);
+    NODEINFO_FIELD(node, limit);
+    NODEINFO_FIELD(node, first_user);
+    NODEINFO_FIELD(node, users);
+    NODEINFO_FIELD(node, history_last);
+    NODEINFO_FIELD(node, fanout);
+    NODEINFO_FIELD(node, fanout_done);
+    NODEINFO_BIT(fanout_behind);
+    NODEINFO_BIT(invite_only);
+    NODEINFO_BIT(moderate);
+    NODEINFO_BIT(private);
+    NODEINFO_BIT(secret);
+    NODEINFO_BIT(topic_restrict);
+
+    NODEINFO_FIELD(node, next_user);
+    NODEINFO_FIELD(node, user[0]);
+    NODEINFO_FIELD(node, user[0].delivered);
+    NODEINFO_FIELD(node, next_channel);
+    NODEINFO_FIELD(node, channel[0]);
+#   undef NODEINFO_FIELD
+#   undef NODEINFO_BIT
+
+    assert(x <= NODEINFO_LAYOUT);
+    return x;
+}
+
+/* The first bit set in n, counting from the least significant bit of its first byte. */
+size_t nodeinfo_layout_bit(node *n) {
+    unsigned char *data = (unsigned char *) n;
+    size_t x = 0;
+    while ((data[x / CHAR_BIT] >> x % CHAR_BIT & 1) == 0) {
+        x++;
+    }
+
+    return x;
+}
+
+node *nodeinfo_link(nodeinfo **list, sockfd fd) {
+    node *l = nodeinfo_add(list, &(node){ .fd = fd,
+                                          .evaluate = server_link_burst,
+                                          .burst_time = nodeinfo_clock() });
+    if (l == NULL) {
+        return NULL;
+    }
+
+    l->next_link = (*list)->first_link;
+    (*list)->first_link = l - (*list)->node + 1;
+    return l;
+}
+
+nodeinfo *nodeinfo_load(FILE *f) {
+    size_t e_size, header[2], layout[NODEINFO_LAYOUT], snapshot_layout[NODEINFO_LAYOUT], layout_size = nodeinfo_layout(layout);
+    evaluatorinfo *e = evaluatorinfo_all(&e_size);
+    char magic[sizeof NODEINFO_MAGIC];
+
+    if (fread(magic, sizeof magic, 1, f) != 1 || memcmp(magic, NODEINFO_MAGIC, sizeof magic) != 0
+     || fread(header, sizeof header, 1, f) != 1 || header[0] != layout_size
+     || fread(snapshot_layout, sizeof *layout, layout_size, f) != layout_size || memcmp(snapshot_layout, layout, layout_size * sizeof *layout) != 0) {
+        return NULL;
+    }
+
+    /* The snapshot names its evaluators, as the new binary's functions are elsewhere. */
+    evaluator **snapshot_e = malloc((header[1] ? header[1] : 1) * sizeof *snapshot_e);
+    if (snapshot_e == NULL) {
+        return NULL;
+    }
+
+    for (size_t x = 0; x < header[1]; x++) {
+        char name[64];
+        size_t y = 0;
+        int c;
+
+        while ((c = fgetc(f)) != EOF && c != '\0' && y < sizeof name - 1) {
+            name[y++] = c;
+        }
+
+        name[y] = '\0';
+        evaluatorinfo *found = c == '\0' ? bsearch(&(evaluatorinfo){ .name = name }, e, e_size, sizeof *e, evaluatorinfo_compare) : NULL;
+        if (found == NULL) {
+            free(snapshot_e);
+            return NULL;
+        }
+
+        snapshot_e[x] = found->evaluate;
+    }
+
+    nodeinfo l;
+    if (fread(&l, sizeof l, 1, f) != 1 || l.size == 0 || SIZE_MAX / 2 / sizeof (node) <= l.size) {
+        free(snapshot_e);
+        return NULL;
+    }
+
+    /* Allocate the capacity nodeinfo_add would have, so it keeps growing on the same schedule. */
+    size_t capacity = 1;
+    while (capacity <= l.size / 2) {
+        capacity *= 2;
+    }
+
+    nodeinfo *list = malloc(sizeof *list + capacity * 2 * sizeof (node));
+    if (list == NULL) {
+        free(snapshot_e);
+        return NULL;
+    }
+
+    *list = l;
+    for (size_t x = 0; x < list->size; x++) {
+        size_t index;
+        if (fread(&index, sizeof index, 1, f) != 1 || index >= header[1] || fread(list->node + x, sizeof *list->node, 1, f) != 1) {
+            free(snapshot_e);
+            free(list);
+            return NULL;
+        }
+
+        node *n = list->node + x;
+        n->evaluate = snapshot_e[index];
+
+        /* A server link's batched records follow it. */
+        if (n->evaluate == server_link || n->evaluate == server_link_burst) {
+            n->linkdata = n->linkdata_capacity ? malloc(n->linkdata_capacity) : NULL;
+            if (n->linkdata_capacity && (n->linkdata == NULL || fread(n->linkdata, 1, n->linkdata_size, f) != n->linkdata_size)) {
+                free(snapshot_e);
+                free(list);
+                return NULL;
+            }
+        }
+
+        /* So do a tagged client's buffer and the tags of the line it is part way through. */
+        if (n->evaluate != channel_info && n->evaluate != channel_user && n->evaluate != user_channel && n->tagdata != NULL) {
+            n->tagdata = malloc(TAGLEN);
+            if (n->tagdata == NULL || fread(n->tagdata, 1, n->tagdata_size, f) != n->tagdata_size) {
+                free(snapshot_e);
+                free(list);
+                return NULL;
+            }
+        }
+
+        /* And the rest of a line it couldn't send at once. */
+        if (n->evaluate != channel_info && n->evaluate != channel_user && n->evaluate != user_channel && n->keptdata != NULL) {
+            n->keptdata = malloc(n->keptdata_size);
+            if (n->keptdata == NULL || fread(n->keptdata, 1, n->keptdata_size, f) != n->keptdata_size) {
+                free(snapshot_e);
+                free(list);
+                return NULL;
+            }
+        }
+    }
+
+    free(snapshot_e);
+    nodeinfo_thaw(list);
+    return list;
+}
+
+/* Ends a pass over the nodes. A node found holding others' indexes is stamped with the pass it was
+ * first seen doing so; nodes freed before the oldest stamp, or before this pass when there is none,
+ * can't be referred to anymore and are reused by nodeinfo_add. Lookups never wait on any of this. */
+void nodeinfo_quiesce(nodeinfo **list) {
+    size_t pass = (*list)->pass++, quiescent = pass + 1;
+
+    for (size_t x = 0; x < (*list)->size; x++) {
+        node *n = (*list)->node + x;
+        if (!node_holds(n)) {
+            n->hold = 0;
+            continue;
+        }
+
+        if (n->hold == 0) {
+            n->hold = pass;
+        }
+
+        if (n->hold < quiescent) {
+            quiescent = n->hold;
+        }
+    }
+
+    (*list)->quiescent = quiescent;
+}
+
+void nodeinfo_remove(nodeinfo **list, node *x) {
+    node **ref = &(*list)->root.node, **xref = NULL, **pref = NULL, **qref = NULL, *n = *ref, *p = NULL, *q = NULL;
+    size_t offset;
+
+    if (n == NULL) {
+        return;
+    }
+
+    do {
+        if (n == x) {
+            xref = ref;
+            qref = pref;
+            q = p;
+        }
+
+        p = n;
+        pref = ref;
+        offset = n->offset;
+        ref = n->next.node + node_bit(x->nickname, offset, NICKLEN);
+        n = *ref;
+    } while (offset < n->offset);
+
+    if (n != x || xref == NULL) {
+        return;
+    }
+
+    /* p holds the only upward link to x. If p is not x, p is unlinked from below x and takes
+     * over x's position and bit offset. If it is x, x's other link replaces x, unless that too
+     * links x to itself: x is then the leaf beyond the last bit, so its parent q no longer
+     * splits anything and is moved down to become that leaf in turn. */
+    node *other = p->next.node[1 - (ref - p->next.node)];
+    if (p != x) {
+        *pref = other;
+        p->offset = x->offset;
+        p->next.node[0] = x->next.node[0];
+        p->next.node[1] = x->next.node[1];
+        *xref = p;
+    }
+    else if (other != x) {
+        *xref = other;
+    }
+    else if (q == NULL) {
+        *xref = NULL;
+    }
+    else {
+        *qref = q->next.node[1 - (xref - q->next.node)];
+
+        ref = qref;
+        if (*ref != q) {
+            do {
+                offset = (*ref)->offset;
+                ref = (*ref)->next.node + node_bit(q->nickname, offset, NICKLEN);
+            } while (offset < (*ref)->offset);
+        }
+
+        q->offset = node_compare(q, q, 0, NICKLEN);
+        q->next.node[0] = q;
+        q->next.node[1] = q;
+        *ref = q;
+    }
+
+    x->next.node[0] = x;
+    x->next.node[1] = x;
+}
+
+int nodeinfo_run(nodeinfo **list, size_t x) {
+    node *u = (*list)->node + x;
+    u->run.quantum = QUANTUM;
     return u->evaluate(u, list);
 }
 
-int user_participation(node *u, nodeinfo **list) {
-    static evaluatorinfo e[] = { { .name = "NICK", .evaluate = user_participation_nickname },
-                                 { .name = "NOTICE", .evaluate = user_participation_notice },
-                                 { .name = "PRIVMSG", .evaluate = user_participation_privmsg },
-                                 { .name = "USER", .evaluate = user_participation_username } };
+int nodeinfo_save(nodeinfo **list, FILE *f) {
+    size_t e_size, layout[NODEINFO_LAYOUT];
+    evaluatorinfo *e = evaluatorinfo_all(&e_size);
+    size_t header[] = { nodeinfo_layout(layout), e_size };
+
+    if (fwrite(NODEINFO_MAGIC, sizeof NODEINFO_MAGIC, 1, f) != 1 || fwrite(header, sizeof header, 1, f) != 1
+     || fwrite(layout, sizeof *layout, header[0], f) != header[0]) {
+        return 0;
+    }
+
+    for (size_t x = 0; x < e_size; x++) {
+        if (fwrite(e[x].name, strlen(e[x].name) + 1, 1, f) != 1) {
+            return 0;
+        }
+    }
+
+    nodeinfo_freeze(*list);
+
+    int success = fwrite(*list, sizeof **list, 1, f) == 1;
+    for (size_t x = 0; success && x < (*list)->size; x++) {
+        node n = (*list)->node[x];
+        size_t index = 0;
+        while (index < e_size && e[index].evaluate != n.evaluate) {
+            index++;
+        }
+
+        n.evaluate = NULL;
+        success = index < e_size && fwrite(&index, sizeof index, 1, f) == 1 && fwrite(&n, sizeof n, 1, f) == 1;
+
+        if (success && (e[index].evaluate == server_link || e[index].evaluate == server_link_burst)) {
+            success = fwrite(n.linkdata, 1, n.linkdata_size, f) == n.linkdata_size;
+        }
+
+        if (success && e[index].evaluate != channel_info && e[index].evaluate != channel_user && e[index].evaluate != user_channel && n.tagdata != NULL) {
+            success = fwrite(n.tagdata, 1, n.tagdata_size, f) == n.tagdata_size;
+        }
+
+        if (success && e[index].evaluate != channel_info && e[index].evaluate != channel_user && e[index].evaluate != user_channel && n.keptdata != NULL) {
+            success = fwrite(n.keptdata, 1, n.keptdata_size, f) == n.keptdata_size;
+        }
+    }
+
+    nodeinfo_thaw(*list);
+    return success && fflush(f) == 0;
+}
+
+void nodeinfo_thaw(nodeinfo *list) {
+    node *l = list->node;
+
+    list->root.node = list->root.offset ? l + list->root.offset : NULL;
+    for (size_t x = 0; x < list->size; x++) {
+        node *n = l + x;
+
+        node *next[2] = { n->next.offset[0] ? l + n->next.offset[0] : NULL,
+                          n->next.offset[1] ? l + n->next.offset[1] : NULL };
+        n->next.node[0] = next[0];
+        n->next.node[1] = next[1];
+
+        if (n->evaluate == channel_user) {
+            n->next_user.node = n->next_user.offset ? l + n->next_user.offset : NULL;
+
+            for (size_t x = 0; x < (sizeof *n - offsetof(node, user)) / sizeof *(n->user); x++) {
+                n->user[x].node = n->user[x].offset ? l + n->user[x].offset : NULL;
+            }
+
+            continue;
+        }
+
+        if (n->evaluate == user_channel) {
+            n->next_channel.node = n->next_channel.offset ? l + n->next_channel.offset : NULL;
+
+            for (size_t x = 0; x < (sizeof *n - offsetof(node, channel)) / sizeof *(n->channel); x++) {
+                n->channel[x].node = n->channel[x].offset ? l + n->channel[x].offset : NULL;
+            }
+
+            continue;
+        }
+
+        node *source = n->source.offset ? l + n->source.offset : NULL;
+        node *target = n->target.offset ? l + n->target.offset : NULL;
+
+        n->source.node = source;
+        n->target.node = target;
+
+        if (n->evaluate == channel_info) {
+            n->first_user.node = n->first_user.offset ? l + n->first_user.offset : NULL;
+            continue;
+        }
+
+        n->first_channel.node = n->first_channel.offset ? l + n->first_channel.offset : NULL;
+    }
+}
+
+evaluatorinfo *evaluatorinfo_all(size_t *size) {
+#   define EVALUATORINFO(e) { .name = #e, .evaluate = e },
+    static evaluatorinfo e[] = { EVALUATORS(EVALUATORINFO) };
+#   undef EVALUATORINFO
     static size_t unsorted = sizeof e / sizeof *e;
     qsort(e, unsorted, sizeof *e, evaluatorinfo_compare);
     unsorted = 0;
 
+    *size = sizeof e / sizeof *e;
+    return e;
+}
+
+int evaluatorinfo_compare(const void *x, const void *y) {
+    return strcmp(((const evaluatorinfo *) x)->name, ((const evaluatorinfo *) y)->name);
+}
+
+int server_accept(node *u, nodeinfo **list) {
+    size_t count = 0;
+    sockfd fd = accept(u->fd);
+
+    if (sock_invalid(fd)) {
+        return 0;
+    }
+
+    node *v;
+    if (!set_nonblock(fd) || (v = nodeinfo_add(list, &(node){ .fd = fd,
+                                                              .evaluate = user_registration })) == NULL) {
+        closesocket(fd);
+        return 0;
+    }
+
+    /* Nodes are reused, so a connection number may recur after its close is recorded. */
+    size_t x = v - (*list)->node + 1;
+    v->capture = capture.file ? x : 0;
+    capturelog_append(&capture, CAPTURE_OPEN, x, NULL, 0);
+    return 0;
+}
+
+int server_link(node *l, nodeinfo **list) {
+    int n = user_send(l, l->linkdata, l->linkdata_size);
+    if (n < 0) {
+        return server_link_cleanup(l, list);
+    }
+
+    if (n > 0) {
+        l->linkdata_size = 0;
+    }
+
+    size_t x = l - (*list)->node;
+    for (;;) {
+        while (l->recvdata_size >= SERVER_RECORD_HEADER) {
+            size_t size = SERVER_RECORD_HEADER + ((unsigned char) l->recvdata[1] << 8 | (unsigned char) l->recvdata[2]);
+            if (size > sizeof l->recvdata) {
+                return server_link_cleanup(l, list);
+            }
+
+            if (size > l->recvdata_size) {
+                break;
+            }
+
+            /* Records may add nodes, moving the link. */
+            n = server_link_evaluate(l, list);
+            l = (*list)->node + x;
+            if (n <= 0) {
+                return n;
+            }
+
+            l->recvdata_size -= size;
+            memmove(l->recvdata, l->recvdata + size, l->recvdata_size);
+        }
+
+        n = user_quantum(l, list);
+        if (n <= 0) {
+            return n;
+        }
+
+        n = recv(l->fd, l->recvdata + l->recvdata_size, sizeof l->recvdata - l->recvdata_size, 0);
+        if (n == 0 || (n < 0 && !sock_again(l->fd))) {
+            return server_link_cleanup(l, list);
+        }
+
+        if (n < 0) {
+            return 1;
+        }
+
+        l->recvdata_size += n;
+    }
+}
+
+int server_link_accept(node *u, nodeinfo **list) {
+    sockfd fd = accept(u->fd);
+
+    if (sock_invalid(fd)) {
+        return 0;
+    }
+
+    if (!set_nonblock(fd) || !nodeinfo_link(list, fd)) {
+        closesocket(fd);
+    }
+
+    return 0;
+}
+
+int server_link_append(node *l, int type, char *data, size_t size) {
+    assert(size <= SERVER_RECORD_SIZE - SERVER_RECORD_HEADER);
+
+    size_t new_size = l->linkdata_size + SERVER_RECORD_HEADER + size;
+    if (new_size > l->linkdata_capacity) {
+        size_t new_capacity = l->linkdata_capacity ? l->linkdata_capacity : LINKBATCH;
+        while (new_capacity < new_size) {
+            if (SIZE_MAX / 2 < new_capacity) { return 0; }
+            new_capacity *= 2;
+        }
+
+        void *temp = realloc(l->linkdata, new_capacity);
+        if (temp == NULL) { return 0; }
+
+        l->linkdata = temp;
+        l->linkdata_capacity = new_capacity;
+    }
+
+    unsigned char *record = (unsigned char *) l->linkdata + l->linkdata_size;
+    record[0] = type;
+    record[1] = size >> 8;
+    record[2] = size & 0xff;
+    memcpy(record + SERVER_RECORD_HEADER, data, size);
+
+    l->linkdata_size = new_size;
+    return 1;
+}
+
+/* Introduces every registered user, local or behind another link, and the channels it is in, in
+ * one pass over the nodes. Records are batched up to LINKBATCH bytes between writes; users
+ * registering, changing nickname or joining meanwhile are also sent as usual, and the peer
+ * ignores what it already knows. */
+int server_link_burst(node *l, nodeinfo **list) {
+    size_t x = l - (*list)->node + 1;
+
+    for (; l->burst < (*list)->size; l->burst++) {
+        if (l->linkdata_size >= LINKBATCH) {
+            int n = user_send(l, l->linkdata, l->linkdata_size);
+            if (n < 0) {
+                return server_link_cleanup(l, list);
+            }
+
+            if (n == 0) {
+                nodeinfo_enqueue(list, l);
+                return 0;
+            }
+
+            l->linkdata_size = 0;
+
+            n = user_quantum(l, list);
+            if (n <= 0) {
+                return n;
+            }
+        }
+
+        node *u = (*list)->node + l->burst;
+        if (u->nickname[0] == '\0' || u->evaluate == channel_info || u->evaluate == server_user_quit || !u->registered || u->link == x) {
+            continue;
+        }
+
+        char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+        server_link_append(l, SERVER_USER, record, server_link_user(u, record));
+
+        size_t block = 0, slot = 0;
+        for (node *c; (c = user_next_channel(list, u, &block, &slot)) != NULL; slot++) {
+            server_link_append(l, SERVER_JOIN, record, server_link_pack(record, 2, u->nickname, (size_t) NICKLEN, c->nickname, (size_t) NICKLEN));
+        }
+    }
+
+    printf("Burst %zu nodes to server link %zu in %.3f ms\n", (*list)->size, x, (nodeinfo_clock() - l->burst_time) / 1000.0);
+    l->evaluate = server_link;
+    return l->evaluate(l, list);
+}
+
+int server_link_cleanup(node *l, nodeinfo **list) {
+    size_t x = l - (*list)->node + 1;
+
+    for (size_t y = 0; y < (*list)->size; y++) {
+        node *v = (*list)->node + y;
+
+        /* A user the link was part way through sending a line to would wait on it forever. The
+         * rest of that line is lost; the count is reset so the next line goes out whole. */
+        if (v->source.node == l) {
+            v->source.node = NULL;
+            v->senddata_size = 0;
+        }
+
+        if (v->evaluate != server_user || v->link != x) {
+            continue;
+        }
+
+        char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+        server_link_propagate(list, x, SERVER_QUIT, record, server_link_pack(record, 2, v->nickname, (size_t) NICKLEN, "Server link closed", sizeof "Server link closed" - 1));
+        server_user_remove(list, v, "Server link closed", sizeof "Server link closed" - 1);
+    }
+
+    for (size_t *next = &(*list)->first_link; *next != 0; next = &(*list)->node[*next - 1].next_link) {
+        if (*next == x) {
+            *next = l->next_link;
+            break;
+        }
+    }
+
+    free(l->linkdata);
+    closesocket(l->fd);
+    nodeinfo_free(list, l);
+    return 0;
+}
+
+int server_link_evaluate(node *l, nodeinfo **list) {
+    size_t size = (unsigned char) l->recvdata[1] << 8 | (unsigned char) l->recvdata[2], x = l - (*list)->node + 1;
+    char *data = l->recvdata + SERVER_RECORD_HEADER, *field[3];
+    size_t field_size[3];
+    node *v;
+
+    switch (l->recvdata[0]) {
+        case SERVER_JOIN:
+            return server_link_join(l, list, data, size);
+
+        case SERVER_KILL:
+            if (server_link_unpack(data, size, field, field_size, 1) != 1 || field_size[0] - 1 >= NICKLEN
+             || (v = nodeinfo_get(list, field[0], field_size[0])) == NULL || v->evaluate == channel_info || v->link == x) {
+                return 1;
+            }
+
+            /* A user behind another link is killed on its own server. */
+            if (v->link != 0) {
+                server_link_append((*list)->node + v->link - 1, SERVER_KILL, data, size);
+                return 1;
+            }
+
+            v->collided = 1;
+            return 1;
+
+        case SERVER_MESSAGE:
+            return server_link_message(l, list, data, size);
+
+        case SERVER_NICKNAME:
+            if (server_link_unpack(data, size, field, field_size, 2) != 2
+             || field_size[0] - 1 >= NICKLEN || field_size[1] - 1 >= NICKLEN || field[1][0] == '#'
+             || (v = nodeinfo_get(list, field[0], field_size[0])) == NULL || v->evaluate != server_user || v->link != x) {
+                return 1;
+            }
+
+            /* A nickname taken on both sides at once is given up by both users: the one behind the
+             * link leaves the network from here and is killed on its server, which kills the other
+             * the same way when the record taking it there arrives. */
+            node *w = nodeinfo_get(list, field[1], field_size[1]);
+            if (w != NULL && w != v) {
+                char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+                server_link_append(l, SERVER_KILL, field[1], field_size[1]);
+                server_link_propagate(list, x, SERVER_QUIT, record, server_link_pack(record, 2, v->nickname, (size_t) NICKLEN, "Nickname collision", sizeof "Nickname collision" - 1));
+                server_user_remove(list, v, "Nickname collision", sizeof "Nickname collision" - 1);
+                return 1;
+            }
+
+            /* The record is evaluated again while the broadcast waits, so it is passed on after. */
+            char line[sizeof ":!@ NICK :\r\n" + NICKLEN + USERLEN + HOSTLEN + NICKLEN];
+            int n = snprintf(line, sizeof line, ":%.*s!%.*s@%.*s NICK :%.*s\r\n", NICKLEN, v->nickname, USERLEN, v->username, HOSTLEN, v->hostname, (int) field_size[1], field[1]);
+            assert(n > 0 && (size_t) n < sizeof line);
+
+            n = user_broadcast(v, list, line, n);
+            if (n <= 0) {
+                return n;
+            }
+
+            server_link_propagate(list, x, SERVER_NICKNAME, data, size);
+
+            nodeinfo_remove(list, v);
+            memcpy(v->nickname, field[1], field_size[1]);
+            memset(v->nickname + field_size[1], 0, NICKLEN - field_size[1]);
+            nodeinfo_insert(list, v);
+            return 1;
+
+        case SERVER_PART:
+            return server_link_part(l, list, data, size);
+
+        case SERVER_QUIT:
+            if (server_link_unpack(data, size, field, field_size, 2) != 2 || field_size[0] - 1 >= NICKLEN
+             || (v = nodeinfo_get(list, field[0], field_size[0])) == NULL || v->evaluate != server_user || v->link != x) {
+                return 1;
+            }
+
+            server_link_propagate(list, x, SERVER_QUIT, data, size);
+            server_user_remove(list, v, field[1], field_size[1]);
+
+            return 1;
+
+        case SERVER_USER:
+            if (server_link_unpack(data, size, field, field_size, 3) != 3
+             || field_size[0] - 1 >= NICKLEN || field_size[1] - 1 >= USERLEN || field_size[2] - 1 >= HOSTLEN || field[0][0] == '#') {
+                return 1;
+            }
+
+            /* A user known by another route has its nickname taken on both sides at once; see SERVER_NICKNAME. */
+            if ((v = nodeinfo_get(list, field[0], field_size[0])) != NULL) {
+                if (v->evaluate != channel_info && v->link != x) {
+                    server_link_append(l, SERVER_KILL, field[0], field_size[0]);
+                }
+
+                return 1;
+            }
+
+            server_link_propagate(list, x, SERVER_USER, data, size);
+
+            node u = { .evaluate = server_user,
+                       .registered = 1,
+                       .link = x };
+            memcpy(u.nickname, field[0], field_size[0]);
+            memcpy(u.username, field[1], field_size[1]);
+            memcpy(u.hostname, field[2], field_size[2]);
+
+            v = nodeinfo_add(list, &u);
+            if (v != NULL) {
+                nodeinfo_insert(list, v);
+            }
+
+            return 1;
+    }
+
+    return 1;
+}
+
+/* A user behind the link joining a channel, which is made if there is none. Adding nodes may
+ * move the link, so the record is copied out of it first. */
+int server_link_join(node *l, nodeinfo **list, char *data, size_t size) {
+    size_t x = l - (*list)->node + 1, field_size[2];
+    char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER], *field[2];
+    memcpy(record, data, size);
+
+    if (server_link_unpack(record, size, field, field_size, 2) != 2 || field_size[0] - 1 >= NICKLEN || field_size[1] - 1 >= NICKLEN || field[1][0] != '#') {
+        return 1;
+    }
+
+    node *v = nodeinfo_get(list, field[0], field_size[0]), *c = nodeinfo_get(list, field[1], field_size[1]);
+    if (v == NULL || v->evaluate != server_user || v->link != x || (c != NULL && (c->evaluate != channel_info || channel_member(c, v)))) {
+        return 1;
+    }
+
+    size_t v_index = v - (*list)->node;
+    if (c == NULL) {
+        node channel = { .evaluate = channel_info };
+        memcpy(channel.nickname, field[1], field_size[1]);
+
+        c = nodeinfo_add(list, &channel);
+        if (c == NULL) {
+            return 0;
+        }
+
+        nodeinfo_insert(list, c);
+        v = (*list)->node + v_index;
+    }
+
+    size_t c_index = c - (*list)->node;
+    if (!channel_join(list, c, v)) {
+        return 0;
+    }
+
+    c = (*list)->node + c_index;
+    v = (*list)->node + v_index;
+    server_link_propagate(list, x, SERVER_JOIN, record, size);
+
+    char line[sizeof ":!@ JOIN \r\n" + NICKLEN + USERLEN + HOSTLEN + NICKLEN];
+    int n = snprintf(line, sizeof line, ":%.*s!%.*s@%.*s JOIN %.*s\r\n", NICKLEN, v->nickname, USERLEN, v->username, HOSTLEN, v->hostname, NICKLEN, c->nickname);
+    assert(n > 0 && (size_t) n < sizeof line);
+
+    c->history_last = historylog_append(&history, c->history_last, 0, 1, 0, line, n);
+    nodeinfo_enqueue(list, c);
+    return 1;
+}
+
+int server_link_message(node *l, nodeinfo **list, char *data, size_t size) {
+    size_t x = l - (*list)->node + 1, field_size[4];
+    char *field[4];
+
+    if (server_link_unpack(data, size, field, field_size, 4) != 4 || field_size[0] - 1 >= NICKLEN || field_size[2] - 1 >= NICKLEN
+     || !((field_size[1] == sizeof "PRIVMSG" - 1 && memcmp(field[1], "PRIVMSG", field_size[1]) == 0)
+       || (field_size[1] == sizeof "NOTICE" - 1 && memcmp(field[1], "NOTICE", field_size[1]) == 0))) {
+        return 1;
+    }
+
+    node *u = nodeinfo_get(list, field[0], field_size[0]), *t = nodeinfo_get(list, field[2], field_size[2]);
+    if (u == NULL || u->evaluate != server_user || u->link != x || t == NULL || (t->evaluate == channel_info ? !channel_member(t, u) : t->link == x)) {
+        return 1;
+    }
+
+    char line[sizeof ":!@   :\r\n" + NICKLEN + USERLEN + HOSTLEN + sizeof "PRIVMSG" + NICKLEN + SERVER_RECORD_SIZE];
+    int n = snprintf(line, sizeof line, ":%.*s!%.*s@%.*s %.*s %.*s :%.*s\r\n", NICKLEN, u->nickname, USERLEN, u->username, HOSTLEN, u->hostname,
+                                                                                (int) field_size[1], field[1], NICKLEN, t->nickname, (int) field_size[3], field[3]);
+    assert(n > 0 && (size_t) n < sizeof line);
+
+    /* A channel logs the line for its members here, and it goes on to every other link. */
+    if (t->evaluate == channel_info) {
+        server_link_propagate(list, x, SERVER_MESSAGE, data, size);
+        t->history_last = historylog_append(&history, t->history_last, u - (*list)->node + 1, 0, 0, line, n);
+        nodeinfo_enqueue(list, t);
+        return 1;
+    }
+
+    if (t->link != 0) {
+        server_link_append((*list)->node + t->link - 1, SERVER_MESSAGE, data, size);
+        return 1;
+    }
+
+    if (t->source.node && t->source.node != l) {
+        return 0;
+    }
+
+    t->source.node = l;
+
+    n = user_send(t, line, n);
+    if (n == 0) {
+        return 0;
+    }
+
+    t->source.node = NULL;
+    return 1;
+}
+
+/* Packs count fields, each given as a pointer and a size_t and cut short at any '\0', into a
+ * record payload; the last field is truncated to fit. */
+size_t server_link_pack(char *data, size_t count, ...) {
+    va_list list;
+    va_start(list, count);
+
+    size_t size = 0;
+    for (size_t x = 0; x < count; x++) {
+        char *field = va_arg(list, char *);
+        size_t field_size = va_arg(list, size_t);
+
+        char *end = memchr(field, '\0', field_size);
+        if (end != NULL) {
+            field_size = end - field;
+        }
+
+        size_t room = SERVER_RECORD_SIZE - SERVER_RECORD_HEADER - size - (x + 1 < count);
+        memcpy(data + size, field, field_size < room ? field_size : room);
+        size += field_size < room ? field_size : room;
+
+        if (x + 1 < count) {
+            data[size++] = '\0';
+        }
+    }
+
+    va_end(list);
+    return size;
+}
+
+/* A user behind the link leaving a channel. Its members here are sent the PART as it leaves; the
+ * user's own server has told it already. */
+int server_link_part(node *l, nodeinfo **list, char *data, size_t size) {
+    size_t x = l - (*list)->node + 1, field_size[3];
+    char *field[3];
+
+    if (server_link_unpack(data, size, field, field_size, 3) != 3 || field_size[0] - 1 >= NICKLEN || field_size[1] - 1 >= NICKLEN) {
+        return 1;
+    }
+
+    node *v = nodeinfo_get(list, field[0], field_size[0]), *c = nodeinfo_get(list, field[1], field_size[1]);
+    if (v == NULL || v->evaluate != server_user || v->link != x || c == NULL || c->evaluate != channel_info || !channel_member(c, v)) {
+        return 1;
+    }
+
+    server_link_propagate(list, x, SERVER_PART, data, size);
+
+    char line[sizeof ":!@ PART  :\r\n" + NICKLEN + USERLEN + HOSTLEN + NICKLEN + SERVER_RECORD_SIZE];
+    int n = snprintf(line, sizeof line, field_size[2] > 0 ? ":%.*s!%.*s@%.*s PART %.*s :%.*s\r\n" : ":%.*s!%.*s@%.*s PART %.*s\r\n",
+                     NICKLEN, v->nickname, USERLEN, v->username, HOSTLEN, v->hostname, NICKLEN, c->nickname, (int) field_size[2], field[2]);
+    assert(n > 0 && (size_t) n < sizeof line);
+
+    c->history_last = historylog_append(&history, c->history_last, 0, 1, 0, line, n);
+    nodeinfo_enqueue(list, c);
+    channel_part(list, c, v);
+    return 1;
+}
+
+void server_link_propagate(nodeinfo **list, size_t except, int type, char *data, size_t size) {
+    for (size_t x = (*list)->first_link; x != 0; x = (*list)->node[x - 1].next_link) {
+        if (x != except) {
+            server_link_append((*list)->node + x - 1, type, data, size);
+        }
+    }
+}
+
+size_t server_link_unpack(char *data, size_t size, char **field, size_t *field_size, size_t count) {
+    char *end = data + size;
+    size_t x = 0;
+
+    while (x < count) {
+        char *separator = x + 1 < count ? memchr(data, '\0', end - data) : NULL;
+        field[x] = data;
+        field_size[x++] = (separator ? separator : end) - data;
+
+        if (separator == NULL) {
+            break;
+        }
+
+        data = separator + 1;
+    }
+
+    return x;
+}
+
+size_t server_link_user(node *u, char *data) {
+    return server_link_pack(data, 3, u->nickname, (size_t) NICKLEN, u->username, (size_t) USERLEN, u->hostname, (size_t) HOSTLEN);
+}
+
+int server_user(node *u, nodeinfo **list) {
+    (void) u;
+    (void) list;
+    return 0;
+}
+
+/* Sends the QUIT of a user that has left the network to its channels' members here, then frees it. */
+int server_user_quit(node *u, nodeinfo **list) {
+    char data[sizeof ":!@ QUIT :\r\n" + NICKLEN + USERLEN + HOSTLEN + sizeof u->recvdata];
+    int n = snprintf(data, sizeof data, ":%.*s!%.*s@%.*s QUIT :%.*s\r\n", NICKLEN, u->nickname, USERLEN, u->username, HOSTLEN, u->hostname, (int) u->recvdata_mark, u->recvdata);
+    assert(n > 0 && (size_t) n < sizeof data);
+
+    n = user_broadcast(u, list, data, n);
+    if (n <= 0) {
+        return n;
+    }
+
+    for (node *c; (c = user_next_channel(list, u, &(size_t){ 0 }, &(size_t){ 0 })) != NULL;) {
+        channel_part(list, c, u);
+    }
+
+    nodeinfo_free(list, u);
+    return 0;
+}
+
+/* Takes a user that has left the network off its link and out of the nickname trie, keeping reason
+ * in recvdata for server_user_quit to send to its channels. */
+void server_user_remove(nodeinfo **list, node *u, char *reason, size_t reason_size) {
+    nodeinfo_remove(list, u);
+
+    u->link = 0;
+    u->recvdata_mark = reason_size < sizeof u->recvdata ? reason_size : sizeof u->recvdata;
+    memcpy(u->recvdata, reason, u->recvdata_mark);
+    u->evaluate = server_user_quit;
+}
+
+/* Sends data to every user sharing a channel with u, once each. A send that has to wait leaves
+ * the broadcast at a cursor over u's channels and their members, which it resumes from. Each
+ * broadcast in progress holds one of BROADCASTS slots, and a user reached is stamped with its
+ * epoch in that slot, so it is skipped in u's later channels whatever other broadcasts reach it
+ * meanwhile. */
+int user_broadcast(node *u, nodeinfo **list, char *data, size_t size) {
+    int n = user_broadcast_begin(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    for (node *c; (c = user_next_channel(list, u, &u->broadcast_block, &u->broadcast_slot)) != NULL; u->broadcast_slot++) {
+        for (node *t; (t = channel_next_user(list, c, &u->broadcast_user_block, &u->broadcast_user_slot)) != NULL; u->broadcast_user_slot++) {
+            if (t == u || !user_local(t) || t->epoch[u->broadcast_id] == u->broadcast) {
+                continue;
+            }
+
+            if (t->source.node && t->source.node != u) {
+                return 0;
+            }
+
+            t->source.node = u;
+
+            n = user_send(t, data, size);
+            if (n == 0) {
+                return 0;
+            }
+
+            t->source.node = NULL;
+            t->epoch[u->broadcast_id] = u->broadcast;
+        }
+
+        u->broadcast_user_block = 0;
+        u->broadcast_user_slot = 0;
+    }
+
+    user_broadcast_end(u, list);
+    return 1;
+}
+
+/* Takes a free broadcast slot for u, unless it holds one already, waiting while there is none. */
+int user_broadcast_begin(node *u, nodeinfo **list) {
+    if (u->broadcast != 0) {
+        return 1;
+    }
+
+    size_t id = 0;
+    while (id < BROADCASTS && (*list)->broadcast[id] != 0) {
+        id++;
+    }
+
+    if (id == BROADCASTS) {
+        return 0;
+    }
+
+    u->broadcast = (*list)->broadcast[id] = ++(*list)->epoch;
+    u->broadcast_id = id;
+    u->broadcast_block = 0;
+    u->broadcast_slot = 0;
+    u->broadcast_user_block = 0;
+    u->broadcast_user_slot = 0;
+    return 1;
+}
+
+/* Gives up the slot of u's broadcast, whether or not it has finished. */
+void user_broadcast_end(node *u, nodeinfo **list) {
+    if (u->broadcast != 0) {
+        (*list)->broadcast[u->broadcast_id] = 0;
+        u->broadcast = 0;
+    }
+}
+
+int user_capability(node *u, nodeinfo **list, evaluator *request, evaluator *discard_line) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    char *nickname = u->nickname[0] == '\0' ? "*" : u->nickname;
+    if (u->recvdata_mark == sizeof "LS" - 1 && memcmp(u->recvdata, "LS", u->recvdata_mark) == 0) {
+        n = sendf(u, ":%s CAP %.*s LS :message-tags\r\n", HOSTNAME, NICKLEN, nickname);
+        if (n <= 0) {
+            return n;
+        }
+
+        u->negotiating = !u->registered;
+    }
+    else if (u->recvdata_mark == sizeof "LIST" - 1 && memcmp(u->recvdata, "LIST", u->recvdata_mark) == 0) {
+        n = sendf(u, ":%s CAP %.*s LIST :%s\r\n", HOSTNAME, NICKLEN, nickname, u->tagdata ? "message-tags" : "");
+        if (n <= 0) {
+            return n;
+        }
+    }
+    else if (u->recvdata_mark == sizeof "END" - 1 && memcmp(u->recvdata, "END", u->recvdata_mark) == 0) {
+        u->negotiating = 0;
+    }
+    else if (u->recvdata_mark == sizeof "REQ" - 1 && memcmp(u->recvdata, "REQ", u->recvdata_mark) == 0 && u->recvdata[u->recvdata_mark] == ' ') {
+        u->negotiating = !u->registered;
+        user_discard(u);
+        u->evaluate = request;
+        return u->evaluate(u, list);
+    }
+    else {
+        return user_error(u, list, discard_line, ":%s 410 %.*s %.*s :Invalid CAP command\r\n");
+    }
+
+    u->evaluate = discard_line;
+    return u->evaluate(u, list);
+}
+
+/* Acknowledges the request only if every capability in it is known, enabling or disabling them all. */
+int user_capability_request(node *u, nodeinfo **list, evaluator *discard_line) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    int ack = 1, tags = u->tagdata != NULL;
+    for (size_t x = 0, y; x < u->recvdata_mark; x = y + 1) {
+        for (y = x; y < u->recvdata_mark && u->recvdata[y] != ' '; y++);
+        if (y == x) {
+            continue;
+        }
+
+        size_t z = x + (u->recvdata[x] == '-');
+        if (y - z != sizeof "message-tags" - 1 || memcmp(u->recvdata + z, "message-tags", y - z) != 0) {
+            ack = 0;
+            break;
+        }
+
+        tags = z == x;
+    }
+
+    /* The buffer for tags is only allocated once a client asks for them. */
+    if (ack && tags && u->tagdata == NULL) {
+        u->tagdata = malloc(TAGLEN);
+        ack = u->tagdata != NULL;
+    }
+    else if (ack && !tags && u->tagdata != NULL) {
+        free(u->tagdata);
+        u->tagdata = NULL;
+        u->tagdata_size = 0;
+    }
+
+    n = sendf(u, ":%s CAP %.*s %s :%.*s\r\n", HOSTNAME, NICKLEN, u->nickname[0] == '\0' ? "*" : u->nickname, ack ? "ACK" : "NAK", (int) u->recvdata_mark, u->recvdata);
+    if (n <= 0) {
+        return n;
+    }
+
+    u->evaluate = discard_line;
+    return u->evaluate(u, list);
+}
+
+int user_channel(node *u, nodeinfo **list) {
+    return 0;
+}
+
+int user_discard(node *u) {
+    u->recvdata_past = u->recvdata[u->recvdata_mark++];
+    if (u->recvdata_past != ' ' && u->recvdata_past != ':') {
+        u->tagdata_size = 0;
+    }
+
+    u->recvdata_size -= u->recvdata_mark;
+    memmove(u->recvdata, u->recvdata + u->recvdata_mark, u->recvdata_size);
+    u->recvdata_mark = 0;
+    return u->recvdata_past;
+}
+
+int user_discard_line(node *u) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+    return user_discard(u) != ' ';
+}
+
+/* Whether u is a user connected here, rather than one behind a server link or quitting from one. */
+int user_local(node *u) {
+    return u->evaluate != server_user && u->evaluate != server_user_quit;
+}
+
+/* The size of the first of the field's comma-separated names. */
+size_t user_list_size(node *u) {
+    char *comma = memchr(u->recvdata, ',', u->recvdata_mark);
+    return comma ? (size_t) (comma - u->recvdata) : u->recvdata_mark;
+}
+
+/* Drops the first of the field's comma-separated names, returning whether another follows. */
+int user_list_next(node *u) {
+    size_t size = user_list_size(u);
+    if (size == u->recvdata_mark) {
+        return 0;
+    }
+
+    size++;
+    u->recvdata_size -= size;
+    u->recvdata_mark -= size;
+    memmove(u->recvdata, u->recvdata + size, u->recvdata_size);
+    return 1;
+}
+
+int user_error(node *u, nodeinfo **list, evaluator *e, char *format) {
+    int n = sendf(u, format, HOSTNAME, NICKLEN, u->nickname[0] == '\0' ? "*" : u->nickname, u->recvdata_mark, u->recvdata);
+    if (n <= 0) {
+        return n;
+    }
+
+    u->evaluate = e;
+    return u->evaluate(u, list);
+}
+
+/* Sends what is left of a line kept by user_send_line, returning 1 once nothing is. */
+int user_flush(node *u) {
+    if (u->keptdata == NULL) {
+        return 1;
+    }
+
+    int n = user_send(u, u->keptdata, u->keptdata_size);
+    if (n <= 0) {
+        return n;
+    }
+
+    free(u->keptdata);
+    u->keptdata = NULL;
+    u->source.node = NULL;
+    return 1;
+}
+
+int user_evaluate(node *u, nodeinfo **list, evaluatorinfo *e, size_t e_size, evaluator *not_enough_parameters, evaluator *unknown_command) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_quantum(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    char past = u->recvdata[u->recvdata_mark];
+    u->recvdata[u->recvdata_mark] = '\0';
+    e = bsearch(&(evaluatorinfo){ .name = u->recvdata }, e, e_size, sizeof *e, evaluatorinfo_compare);
+    u->recvdata[u->recvdata_mark] = past;
+
+    /* The line ends at the command; the bare form is evaluated with the line left to discard. */
+    if (past != ' ') {
+        u->evaluate = e != NULL && e->bare != NULL
+                    ? e->bare
+                    : not_enough_parameters;
+        return u->evaluate(u, list);
+    }
+
+    if (e == NULL) {
+        u->evaluate = unknown_command;
+        return u->evaluate(u, list);
+    }
+
+    u->evaluate = e->evaluate;
+    user_discard(u);
+    return u->evaluate(u, list);
+}
+
+int user_quantum(node *u, nodeinfo **list) {
+    if (u->run.quantum == 0) {
+        nodeinfo_enqueue(list, u);
+        return 0;
+    }
+
+    u->run.quantum--;
+    return 1;
+}
+
+int user_nickname(node *u, nodeinfo **list, evaluator *nickname_success, evaluator *nickname_in_use, evaluator *erroneous_nickname) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    /* Channels share the nickname trie, so a nickname mustn't look like one; an empty one would
+     * be taken for no nickname at all. */
+    if (u->recvdata_mark == 0 || u->recvdata[0] == '#') {
+        u->evaluate = erroneous_nickname;
+        return u->evaluate(u, list);
+    }
+
+    node *v = nodeinfo_get(list, u->recvdata, u->recvdata_mark);
+    u->evaluate = v && v != u
+                ? nickname_in_use
+                : nickname_success;
+    return u->evaluate(u, list);
+}
+
+int user_nickname_success(node *u, nodeinfo **list, evaluator *e) {
+    size_t nickname_size = u->recvdata_mark < NICKLEN ? u->recvdata_mark : NICKLEN;
+
+    u->evaluate = e;
+    memmove(u->nickname, u->recvdata, nickname_size);
+    memset(u->nickname + nickname_size, 0, NICKLEN - nickname_size);
+
+    nodeinfo_insert(list, u);
+    return u->evaluate(u, list);
+}
+
+/* Finds the first of u's channels at or after the cursor given by block, the index of a
+ * user_channel node plus one or zero for the first, and slot, as channel_next_user does. */
+node *user_next_channel(nodeinfo **list, node *u, size_t *block, size_t *slot) {
+    size_t x = *slot;
+    for (node *b = *block ? (*list)->node + *block - 1 : u->first_channel.node; b != NULL; b = b->next_channel.node, x = 0) {
+        for (; x < (sizeof *b - offsetof(node, channel)) / sizeof *(b->channel); x++) {
+            if (b->channel[x].node != NULL) {
+                *block = b - (*list)->node + 1;
+                *slot = x;
+                return b->channel[x].node;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int user_participation(node *u, nodeinfo **list) {
+    static evaluatorinfo e[] = { { .name = "CAP", .evaluate = user_participation_capability },
+                                 { .name = "CHATHISTORY", .evaluate = user_participation_chathistory },
+                                 { .name = "JOIN", .evaluate = user_participation_join },
+                                 { .name = "LIST", .evaluate = user_participation_list, .bare = user_participation_list_all },
+                                 { .name = "NAMES", .evaluate = user_participation_names, .bare = user_participation_names_all },
+                                 { .name = "NICK", .evaluate = user_participation_nickname },
+                                 { .name = "NOTICE", .evaluate = user_participation_notice },
+                                 { .name = "PART", .evaluate = user_participation_part },
+                                 { .name = "PRIVMSG", .evaluate = user_participation_privmsg },
+                                 { .name = "QUIT", .evaluate = user_participation_quit },
+                                 { .name = "USER", .evaluate = user_participation_username },
+                                 { .name = "WHO", .evaluate = user_participation_who } };
+    static size_t unsorted = sizeof e / sizeof *e;
+    qsort(e, unsorted, sizeof *e, evaluatorinfo_compare);
+    unsorted = 0;
+
+    /* A kill from a server link or a channel waits for the command before it to end. */
+    if (u->collided) {
+        u->evaluate = user_participation_quit_collision;
+        return u->evaluate(u, list);
+    }
+
+    if (u->sendq_exceeded) {
+        u->evaluate = user_participation_quit_sendq;
+        return u->evaluate(u, list);
+    }
+
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    return user_evaluate(u, list, e, sizeof e / sizeof *e, user_participation_not_enough_parameters, user_participation_unknown_command);
+}
+
+int user_participation_cannot_send(node *u, nodeinfo **list) {
+    return user_participation_error(u, list, ":%s 404 %.*s %.*s :Cannot send to channel\r\n");
+}
+
+int user_participation_capability(node *u, nodeinfo **list) {
+    return user_capability(u, list, user_participation_capability_request, user_participation_discard_line);
+}
+
+int user_participation_capability_request(node *u, nodeinfo **list) {
+    return user_capability_request(u, list, user_participation_discard_line);
+}
+
+int user_participation_chathistory(node *u, nodeinfo **list) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    if (u->recvdata[u->recvdata_mark] != ' ') {
+        u->evaluate = user_participation_not_enough_parameters;
+        return u->evaluate(u, list);
+    }
+
+    if (u->recvdata_mark != sizeof "LATEST" - 1 || memcmp(u->recvdata, "LATEST", u->recvdata_mark) != 0) {
+        u->evaluate = user_participation_unknown_command;
+        return u->evaluate(u, list);
+    }
+
+    user_discard(u);
+    u->evaluate = user_participation_chathistory_target;
+    return u->evaluate(u, list);
+}
+
+int user_participation_chathistory_limit(node *u, nodeinfo **list) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    size_t limit = 0;
+    for (size_t x = 0; x < u->recvdata_mark; x++) {
+        if (u->recvdata[x] < '0' || u->recvdata[x] > '9') {
+            u->evaluate = user_participation_not_enough_parameters;
+            return u->evaluate(u, list);
+        }
+
+        limit = limit < HISTORYLEN ? limit * 10 + u->recvdata[x] - '0' : HISTORYLEN;
+    }
+
+    /* Find the newest message to leave out: the one past the limit or not after the reference. */
+    node *c = (*list)->node + u->history_channel - 1;
+    u->history_after = 0;
+    u->history_end = c->history_last;
+
+    size_t count = 0;
+    for (size_t p = c->history_last, walked = 0; p != 0 && walked < HISTORYLEN; walked++) {
+        historyentry *e = historylog_entry(&history, p);
+        if (e == NULL) {
+            break;
+        }
+
+        if (!e->quiet && (count == limit || e->time <= u->history_since)) {
+            u->history_after = p;
+            break;
+        }
+
+        count += !e->quiet;
+        p = e->previous;
+    }
+
+    u->evaluate = user_participation_chathistory_replay;
+    return u->evaluate(u, list);
+}
+
+int user_participation_chathistory_reference(node *u, nodeinfo **list) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    u->history_since = 0;
+    if (u->recvdata[u->recvdata_mark] != ' '
+     || !((u->recvdata_mark == 1 && u->recvdata[0] == '*')
+       || (u->recvdata_mark > sizeof "timestamp=" - 1 && memcmp(u->recvdata, "timestamp=", sizeof "timestamp=" - 1) == 0
+        && (u->history_since = historylog_timestamp(u->recvdata + sizeof "timestamp=" - 1, u->recvdata_mark - (sizeof "timestamp=" - 1))) != (time_t) -1))) {
+        u->evaluate = user_participation_not_enough_parameters;
+        return u->evaluate(u, list);
+    }
+
+    user_discard(u);
+    u->evaluate = user_participation_chathistory_limit;
+    return u->evaluate(u, list);
+}
+
+int user_participation_chathistory_replay(node *u, nodeinfo **list) {
+    int n = channel_history((*list)->node + u->history_channel - 1, u);
+    if (n <= 0) {
+        return n;
+    }
+
+    u->evaluate = user_participation_discard_line;
+    return u->evaluate(u, list);
+}
+
+int user_participation_chathistory_target(node *u, nodeinfo **list) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    node *c = nodeinfo_get(list, u->recvdata, u->recvdata_mark);
+    u->evaluate = c == NULL || c->evaluate != channel_info ? user_participation_no_such_channel
+                : !channel_member(c, u) ? user_participation_not_on_channel
+                : u->recvdata[u->recvdata_mark] != ' ' ? user_participation_not_enough_parameters
+                : user_participation_chathistory_reference;
+
+    if (u->evaluate == user_participation_chathistory_reference) {
+        u->history_channel = c - (*list)->node + 1;
+        user_discard(u);
+    }
+
+    return u->evaluate(u, list);
+}
+
+int user_participation_discard_line(node *u, nodeinfo **list) {
+    int n = user_discard_line(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    u->evaluate = user_participation;
+    return u->evaluate(u, list);
+}
+
+int user_participation_error(node *u, nodeinfo **list, char *format) {
+    return user_error(u, list, user_participation_discard_line, format);
+}
+
+/* Joins the first of a comma-separated list of channels, going on to the rest in turn. */
+int user_participation_join(node *u, nodeinfo **list) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    size_t size = user_list_size(u);
+    node *c = nodeinfo_get(list, u->recvdata, size);
+    if (size > NICKLEN || u->recvdata[0] != '#' || (c != NULL && c->evaluate != channel_info)) {
+        u->evaluate = user_participation_join_no_such_channel;
+        return u->evaluate(u, list);
+    }
+
+    /* Channels share the nickname trie, named with a leading '#'. Adding nodes may move u. */
+    size_t x = u - (*list)->node;
+    if (c == NULL) {
+        node channel = { .evaluate = channel_info };
+        memcpy(channel.nickname, u->recvdata, size);
+
+        c = nodeinfo_add(list, &channel);
+        if (c == NULL) {
+            return 0;
+        }
+
+        nodeinfo_insert(list, c);
+        u = (*list)->node + x;
+    }
+
+    if (channel_member(c, u)) {
+        u->evaluate = user_participation_join_next;
+        return u->evaluate(u, list);
+    }
+
+    n = channel_join(list, c, u);
+    u = (*list)->node + x;
+    if (n <= 0) {
+        return n;
+    }
+
+    u->evaluate = user_participation_join_relay;
+    return u->evaluate(u, list);
+}
+
+int user_participation_join_next(node *u, nodeinfo **list) {
+    u->evaluate = user_list_next(u) ? user_participation_join : user_participation_discard_line;
+    return u->evaluate(u, list);
+}
+
+int user_participation_join_no_such_channel(node *u, nodeinfo **list) {
+    return user_participation_list_error(u, list, user_participation_join_next, ":%s 403 %.*s %.*s :No such channel\r\n");
+}
+
+int user_participation_join_relay(node *u, nodeinfo **list) {
+    node *c = nodeinfo_get(list, u->recvdata, user_list_size(u));
+
+    char data[sizeof ":!@ JOIN \r\n" + NICKLEN + USERLEN + HOSTLEN + NICKLEN];
+    int n = snprintf(data, sizeof data, ":%.*s!%.*s@%.*s JOIN %.*s\r\n", NICKLEN, u->nickname, USERLEN, u->username, HOSTLEN, u->hostname, NICKLEN, c->nickname);
+    assert(n > 0 && (size_t) n < sizeof data);
+
+    c->history_last = historylog_append(&history, c->history_last, 0, 1, 0, data, n);
+    nodeinfo_enqueue(list, c);
+
+    char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+    server_link_propagate(list, 0, SERVER_JOIN, record, server_link_pack(record, 2, u->nickname, (size_t) NICKLEN, c->nickname, (size_t) NICKLEN));
+
+    u->evaluate = user_participation_join_next;
+    return u->evaluate(u, list);
+}
+
+/* Replies to the first of a field's comma-separated names with format, then goes on to e. */
+int user_participation_list_error(node *u, nodeinfo **list, evaluator *e, char *format) {
+    int n = sendf(u, format, HOSTNAME, NICKLEN, u->nickname, (int) user_list_size(u), u->recvdata);
+    if (n <= 0) {
+        return n;
+    }
+
+    u->evaluate = e;
+    return u->evaluate(u, list);
+}
+
+int user_participation_list(node *u, nodeinfo **list) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = nodeinfo_enumerate(list, u->recvdata, u->recvdata_mark, u->query, u, user_participation_list_reply);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_flush(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_quantum(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = sendf(u, ":%s 323 %.*s :End of LIST\r\n", HOSTNAME, NICKLEN, u->nickname);
+    if (n <= 0) {
+        return n;
+    }
+
+    memset(u->query, 0, NICKLEN);
+    u->evaluate = user_participation_discard_line;
+    return u->evaluate(u, list);
+}
+
+int user_participation_list_all(node *u, nodeinfo **list) {
+    int n = nodeinfo_enumerate(list, "*", 1, u->query, u, user_participation_list_reply);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_flush(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_quantum(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = sendf(u, ":%s 323 %.*s :End of LIST\r\n", HOSTNAME, NICKLEN, u->nickname);
+    if (n <= 0) {
+        return n;
+    }
+
+    memset(u->query, 0, NICKLEN);
+    u->evaluate = user_participation_discard_line;
+    return u->evaluate(u, list);
+}
+
+int user_participation_list_reply(node *u, nodeinfo **list, node *c) {
+    if (c->evaluate != channel_info || (c->secret && !channel_member(c, u))) {
+        return 1;
+    }
+
+    int n = user_quantum(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    char line[sizeof ": 322    :\r\n" + sizeof HOSTNAME + NICKLEN * 2 + sizeof "18446744073709551615" + TOPICLEN];
+    n = snprintf(line, sizeof line, ":%s 322 %.*s %.*s %zu :%.*s\r\n", HOSTNAME, NICKLEN, u->nickname, NICKLEN, c->nickname, c->users, TOPICLEN, c->topic);
+    assert(n > 0 && (size_t) n < sizeof line);
+
+    n = user_send_line(u, line, n);
+    if (n <= 0) {
+        return n;
+    }
+
+    memcpy(u->query, c->nickname, NICKLEN);
+    return 1;
+}
+
+int user_participation_names(node *u, nodeinfo **list) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    /* The channel's nickname is kept in u->query once its members are sent, so waiting for the last
+     * line doesn't send them again. */
+    node *c = u->recvdata_mark - 1 < NICKLEN ? nodeinfo_get(list, u->recvdata, u->recvdata_mark) : NULL;
+    n = c != NULL && memcmp(u->query, c->nickname, NICKLEN) != 0 ? user_participation_names_reply(u, list, c) : 1;
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_flush(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_quantum(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = sendf(u, ":%s 366 %.*s %.*s :End of NAMES list\r\n", HOSTNAME, NICKLEN, u->nickname, (int) u->recvdata_mark, u->recvdata);
+    if (n <= 0) {
+        return n;
+    }
+
+    memset(u->query, 0, NICKLEN);
+    u->evaluate = user_participation_discard_line;
+    return u->evaluate(u, list);
+}
+
+/* Every visible channel's members, ending with a single 366. */
+int user_participation_names_all(node *u, nodeinfo **list) {
+    int n = nodeinfo_enumerate(list, "*", 1, u->query, u, user_participation_names_reply);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_flush(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_quantum(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = sendf(u, ":%s 366 %.*s * :End of NAMES list\r\n", HOSTNAME, NICKLEN, u->nickname);
+    if (n <= 0) {
+        return n;
+    }
+
+    memset(u->query, 0, NICKLEN);
+    u->evaluate = user_participation_discard_line;
+    return u->evaluate(u, list);
+}
+
+/* Replies with as many members as fit in each line, one line per unit of quantum, going no
+ * further than the client takes; a line part way sent is kept, so members coming and going
+ * meanwhile can't change the rest of it. */
+int user_participation_names_channel(node *u, nodeinfo **list, node *c) {
+    for (;;) {
+        char line[sizeof u->recvdata];
+        size_t size = snprintf(line, sizeof line, ":%s 353 %.*s %c %.*s :", HOSTNAME, NICKLEN, u->nickname, c->secret ? '@' : '=', NICKLEN, c->nickname),
+               block = u->query_block, slot = u->query_slot, count = 0;
+        assert(size < sizeof line - NICKLEN - 2);
+
+        for (node *v; (v = channel_next_user(list, c, &block, &slot)) != NULL; slot++, count++) {
+            char *nickname_end = memchr(v->nickname, '\0', NICKLEN);
+            size_t nickname_size = nickname_end ? nickname_end - v->nickname : NICKLEN;
+            if (size + (count > 0) + nickname_size + 2 > sizeof line) {
+                break;
+            }
+
+            if (count > 0) {
+                line[size++] = ' ';
+            }
+
+            memcpy(line + size, v->nickname, nickname_size);
+            size += nickname_size;
+        }
+
+        if (count == 0) {
+            return 1;
+        }
+
+        memcpy(line + size, "\r\n", 2);
+        size += 2;
+
+        int n = user_quantum(u, list);
+        if (n <= 0) {
+            return n;
+        }
+
+        n = user_send_line(u, line, size);
+        if (n <= 0) {
+            return n;
+        }
+
+        u->query_block = block;
+        u->query_slot = slot;
+    }
+}
+
+/* Replies with a visible channel's members, moving the enumeration past it once they are all sent. */
+int user_participation_names_reply(node *u, nodeinfo **list, node *c) {
+    if (c->evaluate != channel_info || (c->secret && !channel_member(c, u))) {
+        return 1;
+    }
+
+    int n = user_participation_names_channel(u, list, c);
+    if (n <= 0) {
+        return n;
+    }
+
+    memcpy(u->query, c->nickname, NICKLEN);
+    u->query_block = 0;
+    u->query_slot = 0;
+    return 1;
+}
+
+int user_participation_nickname(node *u, nodeinfo **list) {
+    return user_nickname(u, list, user_participation_nickname_success, user_participation_nickname_in_use, user_participation_erroneous_nickname);
+}
+
+int user_participation_nickname_success(node *u, nodeinfo **list) {
+    size_t nickname_size = u->recvdata_mark < NICKLEN ? u->recvdata_mark : NICKLEN;
+    char data[sizeof ":!@ NICK :\r\n" + NICKLEN + USERLEN + HOSTLEN + NICKLEN];
+    int n = snprintf(data, sizeof data, ":%.*s!%.*s@%.*s NICK :%.*s\r\n", NICKLEN, u->nickname, USERLEN, u->username, HOSTLEN, u->hostname, (int) nickname_size, u->recvdata);
+    assert(n > 0 && (size_t) n < sizeof data);
+
+    size_t size = n;
+    n = user_broadcast_begin(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    if (u->epoch[u->broadcast_id] != u->broadcast) {
+        n = user_send(u, data, size);
+        if (n <= 0) {
+            return n;
+        }
+
+        u->epoch[u->broadcast_id] = u->broadcast;
+    }
+
+    n = user_broadcast(u, list, data, size);
+    if (n <= 0) {
+        return n;
+    }
+
+    char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+    server_link_propagate(list, 0, SERVER_NICKNAME, record, server_link_pack(record, 2, u->nickname, (size_t) NICKLEN, u->recvdata, nickname_size));
+
+    size_t x = 0;
+    while (x < nickname_size && CASEMAPPING_TOLOWER(u->nickname[x]) == CASEMAPPING_TOLOWER(u->recvdata[x])) {
+        x++;
+    }
+
+    if (x == nickname_size && (nickname_size == NICKLEN || u->nickname[nickname_size] == '\0')) {
+        memmove(u->nickname, u->recvdata, nickname_size);
+        memset(u->nickname + nickname_size, 0, NICKLEN - nickname_size);
+        u->evaluate = user_participation_discard_line;
+        return u->evaluate(u, list);
+    }
+
+    nodeinfo_remove(list, u);
+    return user_nickname_success(u, list, user_participation_discard_line);
+}
+
+int user_participation_nickname_in_use(node *u, nodeinfo **list) {
+    return user_participation_error(u, list, ":%s 433 %.*s %.*s :Nickname is already in use\r\n");
+}
+
+int user_participation_erroneous_nickname(node *u, nodeinfo **list) {
+    return user_participation_error(u, list, ":%s 432 %.*s %.*s :Erroneous nickname\r\n");
+}
+
+int user_participation_no_such_channel(node *u, nodeinfo **list) {
+    return user_participation_error(u, list, ":%s 403 %.*s %.*s :No such channel\r\n");
+}
+
+int user_participation_not_on_channel(node *u, nodeinfo **list) {
+    return user_participation_error(u, list, ":%s 442 %.*s %.*s :You're not on that channel\r\n");
+}
+
+int user_participation_not_enough_parameters(node *u, nodeinfo **list) {
+    return user_participation_error(u, list, ":%s 461 %.*s %.*s :Not enough parameters\r\n");
+}
+
+int user_participation_message(node *u, nodeinfo **list, evaluator *e) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    size_t target_size = 1;
+    for (char *c = u->recvdata; (c = memchr(c, ',', u->recvdata + u->recvdata_mark - c)) != NULL; c++) {
+        target_size++;
+    }
+
+    if (target_size > MAXTARGETS) {
+        u->evaluate = user_participation_too_many_targets;
+        return u->evaluate(u, list);
+    }
+
+    u->target_size = nodeinfo_getv(list, u->recvdata, u->recvdata_mark, u->target_index, MAXTARGETS);
+
+    char *name = u->recvdata;
+    for (size_t x = 0; x < u->target_size; x++) {
+        char *comma = memchr(name, ',', u->recvdata + u->recvdata_mark - name);
+        size_t name_size = (comma ? comma : u->recvdata + u->recvdata_mark) - name;
+
+        /* A target named again is dropped without a reply, so it is sent the message once. */
+        int repeated = 0;
+        for (size_t y = 0; y < x && u->target_index[x] != 0; y++) {
+            repeated |= u->target_index[y] == u->target_index[x];
+        }
+
+        node *t = u->target_index[x] && !repeated ? (*list)->node + u->target_index[x] - 1 : NULL;
+        char *format = repeated ? NULL
+                     : name_size == 0 ? ":%s 411 %.*s :No recipient given\r\n"
+                     : t == NULL ? ":%s 401 %.*s %.*s :No such nick/channel\r\n"
+                     : t->evaluate == channel_info && !channel_member(t, u) ? ":%s 404 %.*s %.*s :Cannot send to channel\r\n"
+                     : NULL;
+
+        if (format != NULL || repeated) {
+            u->target_index[x] = 0;
+        }
+
+        if (format != NULL && x >= u->target_sent) {
+            n = sendf(u, format, HOSTNAME, NICKLEN, u->nickname, (int) name_size, name);
+            if (n <= 0) {
+                return n;
+            }
+
+            u->target_sent = x + 1;
+        }
+
+        if (comma == NULL) {
+            break;
+        }
+
+        name = comma + 1;
+    }
+
+    u->target_sent = 0;
+    if (user_discard(u) != ' ') {
+        u->evaluate = user_participation;
+        return 1;
+    }
+
+    u->evaluate = e;
+    return u->evaluate(u, list);
+}
+
+int user_participation_notice(node *u, nodeinfo **list) {
+    return debug(user_participation_message(u, list, user_participation_notice_handler));
+}
+
+int user_participation_notice_handler(node *u, nodeinfo **list) {
+    return user_participation_relay_header(u, list, "NOTICE");
+}
+
+/* Leaves the first of a comma-separated list of channels, going on to the rest in turn. */
+int user_participation_part(node *u, nodeinfo **list) {
     int n = user_recv(u);
     if (n <= 0) {
         return n;
     }
 
-    return user_evaluate(u, list, e, sizeof e / sizeof *e, user_participation_not_enough_parameters, user_participation_unknown_command);
+    size_t size = user_list_size(u);
+    node *c = size - 1 < NICKLEN ? nodeinfo_get(list, u->recvdata, size) : NULL;
+    u->evaluate = c == NULL || c->evaluate != channel_info ? user_participation_part_no_such_channel
+                : !channel_member(c, u) ? user_participation_part_not_on_channel
+                : user_participation_part_relay;
+    return u->evaluate(u, list);
 }
 
-int user_participation_discard_line(node *u, nodeinfo **list) {
-    int n = user_discard_line(u);
-    if (n <= 0) {
-        return n;
+/* Leaves the channel once u has been delivered its own PART, so that every line logged before it
+ * reaches u as well. */
+int user_participation_part_leave(node *u, nodeinfo **list) {
+    node *c = nodeinfo_get(list, u->recvdata, user_list_size(u));
+    if (channel_delivered(c, u) < u->history_part) {
+        return 0;
     }
 
-    u->evaluate = user_participation;
+    channel_part(list, c, u);
+    u->history_part = 0;
+    u->evaluate = user_participation_part_next;
     return u->evaluate(u, list);
 }
 
-int user_participation_error(node *u, nodeinfo **list, char *format) {
-    return user_error(u, list, user_participation_discard_line, format);
+int user_participation_part_next(node *u, nodeinfo **list) {
+    u->evaluate = user_list_next(u) ? user_participation_part : user_participation_discard_line;
+    return u->evaluate(u, list);
 }
 
-int user_participation_join(node *u, nodeinfo **list) {
-    assert(0);
-    return 0;
+int user_participation_part_no_such_channel(node *u, nodeinfo **list) {
+    return user_participation_list_error(u, list, user_participation_part_next, ":%s 403 %.*s %.*s :No such channel\r\n");
 }
 
-int user_participation_nickname(node *u, nodeinfo **list) {
-    return user_nickname(u, list, user_participation_nickname_success, user_participation_nickname_in_use);
+int user_participation_part_not_on_channel(node *u, nodeinfo **list) {
+    return user_participation_list_error(u, list, user_participation_part_next, ":%s 442 %.*s %.*s :You're not on that channel\r\n");
 }
 
-int user_participation_nickname_success(node *u, nodeinfo **list) {
-    size_t nickname_size = u->recvdata_mark < NICKLEN ? u->recvdata_mark : NICKLEN;
-    int n = sendf(u, ":%.*s NICK :%.*s\r\n", NICKLEN, u->nickname, nickname_size, u->recvdata);
+/* Logs the PART for the channel's members, u among them. The reason follows the channels, so the
+ * rest of the line, which fits in recvdata, is looked ahead to. */
+int user_participation_part_relay(node *u, nodeinfo **list) {
+    int n = user_recv(u);
     if (n <= 0) {
         return n;
     }
 
-    size_t x;
-    while (x < nickname_size && CASEMAPPING.tolower(u->nickname[x]) != CASEMAPPING.tolower(u->recvdata[x])) {
-        x++;
+    char *reason = u->recvdata + u->recvdata_mark, *end = reason;
+    while (end < u->recvdata + u->recvdata_size && *end != '\r' && *end != '\n') {
+        end++;
     }
 
-    if (x == nickname_size) {
-        memmove(u->nickname, u->recvdata, nickname_size);
-        memset(u->nickname + nickname_size, 0, NICKLEN - nickname_size);
-        u->evaluate = user_participation_discard_line;
-        return u->evaluate(u, list);
+    if (end == u->recvdata + u->recvdata_size && u->recvdata_size < sizeof u->recvdata) {
+        return 0;
     }
 
-    node **v = nodeinfo_getref(list, u->nickname, NICKLEN);
-    do {
-        *v = (*v)->next.node[0];
-    } while ((*v)->next.node[0] != u);
+    reason += reason < end && *reason == ' ';
+    reason += reason < end && *reason == ':';
 
-    node *w = (*v)->next.node[1];
-    (*v)->next.node[0] = u->next.node[0];
-    (*v)->next.node[1] = u->next.node[1];
-    *v = w;
+    node *c = nodeinfo_get(list, u->recvdata, user_list_size(u));
 
-    return user_nickname_success(u, list, user_participation_discard_line);
-}
+    char data[sizeof ":!@ PART  :\r\n" + NICKLEN + USERLEN + HOSTLEN + NICKLEN + sizeof u->recvdata];
+    n = snprintf(data, sizeof data, reason < end ? ":%.*s!%.*s@%.*s PART %.*s :%.*s\r\n" : ":%.*s!%.*s@%.*s PART %.*s\r\n",
+                 NICKLEN, u->nickname, USERLEN, u->username, HOSTLEN, u->hostname, NICKLEN, c->nickname, (int) (end - reason), reason);
+    assert(n > 0 && (size_t) n < sizeof data);
 
-int user_participation_nickname_in_use(node *u, nodeinfo **list) {
-    return user_participation_error(u, list, ":%s 433 %.*s %.*s :Nickname is already in use\r\n");
+    c->history_last = historylog_append(&history, c->history_last, 0, 1, 0, data, n);
+    u->history_part = c->history_last;
+    nodeinfo_enqueue(list, c);
+
+    char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+    server_link_propagate(list, 0, SERVER_PART, record, server_link_pack(record, 3, u->nickname, (size_t) NICKLEN, c->nickname, (size_t) NICKLEN, reason, (size_t) (end - reason)));
+
+    u->evaluate = user_participation_part_leave;
+    return u->evaluate(u, list);
 }
 
-int user_participation_no_such_entity(node *u, nodeinfo **list) {
-    return user_participation_error(u, list, ":%s 401 %.*s %.*s :No such nick/channel\r\n");
+int user_participation_privmsg(node *u, nodeinfo **list) {
+    return user_participation_message(u, list, user_participation_privmsg_handler);
 }
 
-int user_participation_not_enough_parameters(node *u, nodeinfo **list) {
-    return user_participation_error(u, list, ":%s 461 %.*s %.*s :Not enough parameters\r\n");
+int user_participation_privmsg_handler(node *u, nodeinfo **list) {
+    return user_participation_relay_header(u, list, "PRIVMSG");
 }
 
-int user_participation_message(node *u, nodeinfo **list, evaluator *e) {
+int user_participation_quit(node *u, nodeinfo **list) {
     int n = user_recv(u);
     if (n <= 0) {
         return n;
     }
 
-    node *t = nodeinfo_get(list, u->recvdata, u->recvdata_mark);
-    if (t == NULL) {
-        u->evaluate = user_participation_no_such_entity;
-        return u->evaluate(u, list);
-    }
+    char reason[sizeof "Quit: " + sizeof u->recvdata], data[sizeof ":!@ QUIT :\r\n" + NICKLEN + USERLEN + HOSTLEN + sizeof reason];
+    int reason_size = snprintf(reason, sizeof reason, "Quit: %.*s", (int) u->recvdata_mark, u->recvdata);
+    n = snprintf(data, sizeof data, ":%.*s!%.*s@%.*s QUIT :%s\r\n", NICKLEN, u->nickname, USERLEN, u->username, HOSTLEN, u->hostname, reason);
+    assert(reason_size > 0 && (size_t) reason_size < sizeof reason && n > 0 && (size_t) n < sizeof data);
 
-    if (user_discard(u) != ' ') {
-        u->evaluate = user_participation;
-        return 1;
+    n = user_broadcast(u, list, data, n);
+    if (n <= 0) {
+        return n;
     }
 
-    u->target.node = t;
-    u->evaluate = e;
+    char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+    server_link_propagate(list, 0, SERVER_QUIT, record, server_link_pack(record, 2, u->nickname, (size_t) NICKLEN, reason, (size_t) reason_size));
+
+    /* The ERROR may have to wait, and the QUIT mustn't go out again meanwhile. */
+    u->evaluate = user_participation_quit_error;
     return u->evaluate(u, list);
 }
 
-int user_participation_notice(node *u, nodeinfo **list) {
-    return debug(user_participation_message(u, list, user_participation_notice_handler));
+/* Sends the QUIT of a user the server disconnects for reason to its channels and the other servers, then cleans it up. */
+int user_participation_quit_closed(node *u, nodeinfo **list, char *reason) {
+    char data[sizeof ":!@ QUIT :\r\n" + NICKLEN + USERLEN + HOSTLEN + sizeof "Nickname collision"];
+    int n = snprintf(data, sizeof data, ":%.*s!%.*s@%.*s QUIT :%s\r\n", NICKLEN, u->nickname, USERLEN, u->username, HOSTLEN, u->hostname, reason);
+    assert(n > 0 && (size_t) n < sizeof data);
+
+    n = user_broadcast(u, list, data, n);
+    if (n <= 0) {
+        return n;
+    }
+
+    if (u->registered) {
+        char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+        server_link_propagate(list, 0, SERVER_QUIT, record, server_link_pack(record, 2, u->nickname, (size_t) NICKLEN, reason, strlen(reason)));
+    }
+
+    return node_cleanup(u, list);
 }
 
-int user_participation_notice_handler(node *u, nodeinfo **list) {
-    return user_participation_relay_header(u, list, "NOTICE");
+int user_participation_quit_collision(node *u, nodeinfo **list) {
+    return user_participation_quit_closed(u, list, "Nickname collision");
 }
 
-int user_participation_privmsg(node *u, nodeinfo **list) {
-    return user_participation_message(u, list, user_participation_privmsg_handler);
+int user_participation_quit_lost(node *u, nodeinfo **list) {
+    return user_participation_quit_closed(u, list, "Connection closed");
 }
 
-int user_participation_privmsg_handler(node *u, nodeinfo **list) {
-    return user_participation_relay_header(u, list, "PRIVMSG");
+int user_participation_quit_sendq(node *u, nodeinfo **list) {
+    return user_participation_quit_closed(u, list, "SendQ exceeded");
 }
 
-int user_participation_relay_header(node *u, nodeinfo **list, char *action) {
-    node *t = u->target.node;
-    if (t->source.node && t->source.node != u) {
-        return 1;
+int user_participation_quit_error(node *u, nodeinfo **list) {
+    int n = sendf(u, "ERROR :Closing Link: %.*s (Quit: %.*s)\r\n", HOSTLEN, u->hostname, (int) u->recvdata_mark, u->recvdata);
+    if (n == 0) {
+        return n;
     }
 
-    t->source.node = u;
+    return node_cleanup(u, list);
+}
 
-    int n = sendf(t, ":%.*s!%.*s@%.*s %s %.*s :", NICKLEN, u->nickname, USERLEN, u->username, HOSTLEN, u->hostname, action, NICKLEN, t->nickname);
-    if (n <= 0) {
-        return 1;
-    }
+int user_participation_relay_header(node *u, nodeinfo **list, char *action) {
+    int n = snprintf(u->header, sizeof u->header, ":%.*s!%.*s@%.*s %s ", NICKLEN, u->nickname, USERLEN, u->username, HOSTLEN, u->hostname, action);
+    assert(n > 0 && (size_t) n < sizeof u->header);
 
+    u->header_size = n;
     u->evaluate = user_participation_relay_message;
     return u->evaluate(u, list);
 }
@@ -505,20 +2872,94 @@ int user_participation_relay_message(node *u, nodeinfo **list) {
         return n;
     }
 
-    node *t = u->target.node;
-    t->source.node = u;
+    /* The line differs between recipients only by their nickname, so it is assembled from
+     * the header formatted once in user_participation_relay_header and the body as received.
+     * Any tag section goes just before it, as received, for recipients that take tags. */
+    char buffer[TAGLEN + sizeof u->header + NICKLEN + sizeof u->recvdata + sizeof " :\r\n"], *line = buffer + TAGLEN, *tags = line - u->tagdata_size;
+    if (u->tagdata_size > 0) {
+        memcpy(tags, u->tagdata, u->tagdata_size);
+    }
 
-    n = user_send(t, u->recvdata, u->recvdata_size);
-    if (n <= 0) {
-        return 1;
+    memcpy(line, u->header, u->header_size);
+
+    /* Targets behind a server link are sent a record instead, naming the action: the header's last word. */
+    char *action = u->header + u->header_size - 1;
+    while (action[-1] != ' ') {
+        action--;
+    }
+
+    for (; u->target_sent < u->target_size; u->target_sent++) {
+        if (u->target_index[u->target_sent] == 0) {
+            continue;
+        }
+
+        /* The target may have quit since it was looked up; its node is held, but freed or quitting. */
+        node *t = (*list)->node + u->target_index[u->target_sent] - 1;
+        if (t->evaluate == node_unused || t->evaluate == server_user_quit) {
+            continue;
+        }
+
+        /* Each target takes a line of u's quantum; one part way sent was charged when it began. */
+        if ((t->evaluate == channel_info || t->source.node != u) && (n = user_quantum(u, list)) <= 0) {
+            return n;
+        }
+
+        if (t->evaluate != channel_info && t->link != 0) {
+            char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+            server_link_append((*list)->node + t->link - 1, SERVER_MESSAGE, record,
+                               server_link_pack(record, 4, u->nickname, (size_t) NICKLEN, action, (size_t) (u->header + u->header_size - 1 - action),
+                                                           t->nickname, (size_t) NICKLEN, u->recvdata, u->recvdata_mark));
+            continue;
+        }
+
+        if (t->evaluate != channel_info && t->source.node && t->source.node != u) {
+            return 1;
+        }
+
+        char *nickname_end = memchr(t->nickname, '\0', NICKLEN);
+        size_t size = u->header_size, nickname_size = nickname_end ? nickname_end - t->nickname : NICKLEN;
+        memcpy(line + size, t->nickname, nickname_size);
+        size += nickname_size;
+        memcpy(line + size, " :", 2);
+        size += 2;
+        memcpy(line + size, u->recvdata, u->recvdata_mark);
+        size += u->recvdata_mark;
+        memcpy(line + size, "\r\n", 2);
+        size += 2;
+
+        /* A channel logs the line, and delivers it to every member but u as it takes its turns; other
+         * servers are sent it for their members. */
+        if (t->evaluate == channel_info) {
+            t->history_last = historylog_append(&history, t->history_last, u - (*list)->node + 1, 0, u->tagdata_size, tags, u->tagdata_size + size);
+            nodeinfo_enqueue(list, t);
+
+            char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+            server_link_propagate(list, 0, SERVER_MESSAGE, record,
+                                  server_link_pack(record, 4, u->nickname, (size_t) NICKLEN, action, (size_t) (u->header + u->header_size - 1 - action),
+                                                              t->nickname, (size_t) NICKLEN, u->recvdata, u->recvdata_mark));
+            continue;
+        }
+
+        t->source.node = u;
+
+        n = t->tagdata ? user_send(t, tags, u->tagdata_size + size) : user_send(t, line, size);
+        if (n == 0) {
+            return 1;
+        }
+
+        t->source.node = NULL;
     }
 
+    u->target_sent = 0;
     user_discard(u);
     u->evaluate = user_participation;
-    t->source.node = NULL;
     return 1;
 }
 
+int user_participation_too_many_targets(node *u, nodeinfo **list) {
+    return user_participation_error(u, list, ":%s 407 %.*s %.*s :Too many recipients\r\n");
+}
+
 int user_participation_unknown_command(node *u, nodeinfo **list) {
     return user_participation_error(u, list, ":%s 421 %.*s %.*s :Unknown command\r\n");
 }
@@ -536,36 +2977,217 @@ int user_participation_welcome(node *u, nodeinfo **list) {
         return n;
     }
 
+    u->evaluate = user_participation_welcome_isupport;
+    return u->evaluate(u, list);
+}
+
+int user_participation_welcome_isupport(node *u, nodeinfo **list) {
+    int n = sendf(u, ":%s 005 %.*s CASEMAPPING=%s CHANTYPES=# CHANNELLEN=%d CHATHISTORY=%d MAXTARGETS=%d TARGMAX=PRIVMSG:%d,NOTICE:%d NICKLEN=%d TOPICLEN=%d :are supported by this server\r\n",
+                  HOSTNAME, NICKLEN, u->nickname, CASEMAPPING.description, NICKLEN, HISTORYLEN, MAXTARGETS, MAXTARGETS, MAXTARGETS, NICKLEN, TOPICLEN);
+    if (n <= 0) {
+        return n;
+    }
+
     u->evaluate = user_participation;
     return 1;
 }
 
+int user_participation_who(node *u, nodeinfo **list) {
+    int n = user_recv(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    /* A channel's members are listed in place of the nicknames matching a mask. */
+    node *c = u->recvdata_mark - 1 < NICKLEN ? nodeinfo_get(list, u->recvdata, u->recvdata_mark) : NULL;
+    n = c != NULL && c->evaluate == channel_info
+      ? user_participation_who_channel(u, list, c)
+      : nodeinfo_enumerate(list, u->recvdata, u->recvdata_mark, u->query, u, user_participation_who_reply);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_flush(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = user_quantum(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    n = sendf(u, ":%s 315 %.*s %.*s :End of WHO list\r\n", HOSTNAME, NICKLEN, u->nickname, (int) u->recvdata_mark, u->recvdata);
+    if (n <= 0) {
+        return n;
+    }
+
+    memset(u->query, 0, NICKLEN);
+    u->query_block = 0;
+    u->query_slot = 0;
+    u->evaluate = user_participation_discard_line;
+    return u->evaluate(u, list);
+}
+
+int user_participation_who_channel(node *u, nodeinfo **list, node *c) {
+    if (c->secret && !channel_member(c, u)) {
+        return 1;
+    }
+
+    for (node *v; (v = channel_next_user(list, c, &u->query_block, &u->query_slot)) != NULL; u->query_slot++) {
+        int n = user_participation_who_line(u, list, c->nickname, v);
+        if (n <= 0) {
+            return n;
+        }
+    }
+
+    return 1;
+}
+
+int user_participation_who_line(node *u, nodeinfo **list, char *channel, node *v) {
+    int n = user_quantum(u, list);
+    if (n <= 0) {
+        return n;
+    }
+
+    char line[sizeof ": 352       H :0 \r\n" + sizeof HOSTNAME * 2 + NICKLEN * 3 + USERLEN * 2 + HOSTLEN];
+    n = snprintf(line, sizeof line, ":%s 352 %.*s %.*s %.*s %.*s %s %.*s H :0 %.*s\r\n", HOSTNAME, NICKLEN, u->nickname, NICKLEN, channel, USERLEN, v->username, HOSTLEN, v->hostname,
+                                                                                      HOSTNAME, NICKLEN, v->nickname, USERLEN, v->username);
+    assert(n > 0 && (size_t) n < sizeof line);
+    return user_send_line(u, line, n);
+}
+
+int user_participation_who_reply(node *u, nodeinfo **list, node *v) {
+    if (v->evaluate == channel_info) {
+        return 1;
+    }
+
+    int n = user_participation_who_line(u, list, "*", v);
+    if (n <= 0) {
+        return n;
+    }
+
+    memcpy(u->query, v->nickname, NICKLEN);
+    return 1;
+}
+
+/* Returns -1 once the connection has closed or failed with no whole field left to evaluate, having
+ * set u to quit as though it had sent QUIT. */
 int user_recv(node *u) {
-    int n = recv(u->fd, u->recvdata + u->recvdata_size, sizeof u->recvdata - u->recvdata_size, 0);
-    if (n < 0) {
-        switch (sock_again(fd)) {
-            case 0: return n;
-            case 1: n = 0;
-                    break;
+    int closed = 0;
+    for (;;) {
+        int n = recv(u->fd, u->recvdata + u->recvdata_size, sizeof u->recvdata - u->recvdata_size, 0);
+        closed |= n == 0 && u->recvdata_size < sizeof u->recvdata;
+        if (n < 0) {
+            switch (sock_again(fd)) {
+                case 0: closed = 1;
+                        /* fall through */
+                case 1: n = 0;
+                        break;
+            }
+        }
+
+        if (n > 0 && u->capture) {
+            capturelog_append(&capture, CAPTURE_DATA, u->capture, u->recvdata + u->recvdata_size, n);
+        }
+
+        u->recvdata_size += n;
+
+        /* Only a tag section can take more than recvdata holds, and it is moved out as it arrives. */
+        int m = u->tagdata ? user_recv_tags(u) : 1;
+        if (m < 0) {
+            return m;
+        }
+
+        if (m > 0) {
+            break;
+        }
+
+        if (n == 0) {
+            goto end;
         }
     }
 
     int past = u->recvdata_past;
-    if (past == ' ' && u->recvdata[0] == ':') {
+    if (past == ' ' && u->recvdata_size > 0 && u->recvdata[0] == ':') {
         past = user_discard(u);
     }
 
-    for (u->recvdata_size += n; u->recvdata_mark < u->recvdata_size; u->recvdata_mark++) {
+    for (; u->recvdata_mark < u->recvdata_size; u->recvdata_mark++) {
         if (memchr(" \r\n\0" + (past == ':'), u->recvdata[u->recvdata_mark], 4 - (past == ':')) != NULL) {
             return 1;
         }
     }
 
-end:return u->recvdata_mark < sizeof u->recvdata ? 0 : -1;
+end:if (closed) {
+        u->evaluate = user_participation_quit_lost;
+        return -1;
+    }
+
+    return u->recvdata_mark < sizeof u->recvdata ? 0 : -1;
+}
+
+/* Moves a tag section starting a line from recvdata into tagdata, through the space ending it, and
+ * marks the line as tagged for the command that follows. Returns 0 while the section is incomplete
+ * and recvdata has been emptied, -1 if it is longer than TAGLEN. */
+int user_recv_tags(node *u) {
+    int past = u->recvdata_past;
+    if (past == ' ' || past == ':' || past == '@' || (u->tagdata_size == 0 && (u->recvdata_size == 0 || u->recvdata[0] != '@'))) {
+        return 1;
+    }
+
+    size_t size = 0;
+    while (size < u->recvdata_size && memchr(" \r\n", u->recvdata[size], 4) == NULL) {
+        size++;
+    }
+
+    int end = size < u->recvdata_size && u->recvdata[size] == ' ';
+    size += end;
+    if (u->tagdata_size + size > TAGLEN) {
+        return -1;
+    }
+
+    memcpy(u->tagdata + u->tagdata_size, u->recvdata, size);
+    u->tagdata_size += size;
+    u->recvdata_size -= size;
+    memmove(u->recvdata, u->recvdata + size, u->recvdata_size);
+
+    if (end) {
+        u->recvdata_past = '@';
+        user_recv_tags_filter(u);
+        return 1;
+    }
+
+    /* A line of nothing but tags is left for the evaluator to find empty. */
+    return u->recvdata_size > 0;
+}
+
+/* Drops every tag but the client-only ones, named with a leading '+', from a complete tag section:
+ * the rest are the server's to vouch for, so a client mustn't be able to pass them on. A section left
+ * with none is dropped along with them. */
+void user_recv_tags_filter(node *u) {
+    size_t size = 1;
+    for (size_t x = 1, y; x < u->tagdata_size - 1; x = y + 1) {
+        for (y = x; y < u->tagdata_size - 1 && u->tagdata[y] != ';'; y++);
+        if (u->tagdata[x] != '+') {
+            continue;
+        }
+
+        if (size > 1) {
+            u->tagdata[size++] = ';';
+        }
+
+        memmove(u->tagdata + size, u->tagdata + x, y - x);
+        size += y - x;
+    }
+
+    u->tagdata[size++] = ' ';
+    u->tagdata_size = size > 2 ? size : 0;
 }
 
 int user_registration(node *u, nodeinfo **list) {
-    static evaluatorinfo e[] = { { .name = "NICK", .evaluate = user_registration_nickname },
+    static evaluatorinfo e[] = { { .name = "CAP", .evaluate = user_registration_capability },
+                                 { .name = "NICK", .evaluate = user_registration_nickname },
                                  { .name = "USER", .evaluate = user_registration_username } };
     static size_t unsorted = sizeof e / sizeof *e;
     qsort(e, unsorted, sizeof *e, evaluatorinfo_compare);
@@ -580,18 +3202,56 @@ int user_registration_discard_line(node *u, nodeinfo **list) {
         return n;
     }
 
-    u->evaluate = u->nickname[0] == '\0' || u->username[0] == '\0'
-                ? user_registration
-                : user_participation_welcome;
+    if (u->nickname[0] == '\0' || u->username[0] == '\0' || u->negotiating) {
+        u->evaluate = user_registration;
+        return u->evaluate(u, list);
+    }
+
+    /* The match is kept for user_registration_banned, which is evaluated again while its reply waits. */
+    maskinfo *b = user_registration_match(u);
+    u->ban = b ? (size_t) ((ban *) b - bans.ban) + 1 : 0;
+    u->evaluate = u->ban ? user_registration_banned : user_participation_welcome;
+
+    if (u->evaluate == user_participation_welcome) {
+        char record[SERVER_RECORD_SIZE - SERVER_RECORD_HEADER];
+        u->registered = 1;
+        server_link_propagate(list, 0, SERVER_USER, record, server_link_user(u, record));
+    }
+
     return u->evaluate(u, list);
 }
 
+int user_registration_banned(node *u, nodeinfo **list) {
+    maskinfo *b = &bans.ban[u->ban - 1].info;
+    int n = sendf(u, ":%s 465 %.*s :You are banned from this server (%s)\r\nERROR :Closing Link: %.*s (%s)\r\n", HOSTNAME, NICKLEN, u->nickname, b->reason,
+                                                                                                                  HOSTLEN, u->hostname, b->reason);
+    if (n == 0) {
+        return n;
+    }
+
+    return node_cleanup(u, list);
+}
+
+int user_registration_capability(node *u, nodeinfo **list) {
+    return user_capability(u, list, user_registration_capability_request, user_registration_discard_line);
+}
+
+int user_registration_capability_request(node *u, nodeinfo **list) {
+    return user_capability_request(u, list, user_registration_discard_line);
+}
+
+maskinfo *user_registration_match(node *u) {
+    char *nickname_end = memchr(u->nickname, '\0', NICKLEN), *username_end = memchr(u->username, '\0', USERLEN);
+    return banlist_match(&bans, u->nickname, nickname_end ? (size_t) (nickname_end - u->nickname) : NICKLEN,
+                                u->username, username_end ? (size_t) (username_end - u->username) : USERLEN, u->hostname, u->address);
+}
+
 int user_registration_error(node *u, nodeinfo **list, char *format) {
     return user_error(u, list, user_registration_discard_line, format);
 }
 
 int user_registration_nickname(node *u, nodeinfo **list) {
-    return user_nickname(u, list, user_registration_nickname_success, user_registration_nickname_in_use);
+    return user_nickname(u, list, user_registration_nickname_success, user_registration_nickname_in_use, user_registration_erroneous_nickname);
 }
 
 int user_registration_nickname_success(node *u, nodeinfo **list) {
@@ -602,6 +3262,10 @@ int user_registration_nickname_in_use(node *u, nodeinfo **list) {
     return user_registration_error(u, list, ":%s 433 %.*s %.*s :Nickname is already in use\r\n");
 }
 
+int user_registration_erroneous_nickname(node *u, nodeinfo **list) {
+    return user_registration_error(u, list, ":%s 432 %.*s %.*s :Erroneous nickname\r\n");
+}
+
 int user_registration_not_enough_parameters(node *u, nodeinfo **list) {
     return user_registration_error(u, list, ":%s 461 %.*s %.*s :Not enough parameters\r\n");
 }
@@ -622,40 +3286,90 @@ int user_registration_username(node *u, nodeinfo **list) {
     memmove(u->username, u->recvdata, username_size);
     memset(u->username + username_size, 0, USERLEN - username_size);
 
-    struct sockaddr name;
+    struct sockaddr_storage name;
+    socklen_t name_size = sizeof name;
 
-    n = sock_invalid(getpeername(u->fd, &name, (socklen_t[]) { sizeof name }));
-    assert(n == 0);
+    /* The client may already have hung up. */
+    if (sock_invalid(getpeername(u->fd, (struct sockaddr *) &name, &name_size))) {
+        return node_cleanup(u, list);
+    }
 
-    n = getnameinfo(&name, sizeof name, u->hostname, HOSTLEN, NULL, 0, NI_NUMERICHOST);
+    n = getnameinfo((struct sockaddr *) &name, name_size, u->hostname, HOSTLEN, NULL, 0, NI_NUMERICHOST);
     assert(n == 0);
 
+    mask_sockaddr((struct sockaddr *) &name, u->address);
+
     u->evaluate = user_registration_discard_line;
     return u->evaluate(u, list);
 }
 
-int channel_send(node *c, char *data, size_t size) {
+/* Sends each member the lines logged after its cursor, up to c->fanout, resuming from the member
+ * the last call stopped at. The first tags bytes of a line are its tag section, sent only to members
+ * that negotiated message-tags; a line naming its sender is skipped for that member. */
+int channel_send(node *c, nodeinfo **list) {
     for (node *target = c->target.node ? c->target.node : c->first_user.node; target != NULL; target = target->next_user.node) {
-        while (target->target.offset < (sizeof *target - offsetof(node, user)) / sizeof *(target->user)) {
+        for (; target->target.offset < (sizeof *target - offsetof(node, user)) / sizeof *(target->user); target->target.offset++) {
             node *u = target->user[target->target.offset].node;
-            if (!u) {
-                target->target.offset++;
+            size_t *delivered = &target->user[target->target.offset].delivered;
+
+            /* Members behind a server link are delivered the lines by their own server, and those
+             * that fell too far behind are sent nothing more before they are disconnected. */
+            if (u != NULL && (!user_local(u) || u->sendq_exceeded)) {
+                if (u->source.node == target) {
+                    u->source.node = NULL;
+                    u->senddata_size = 0;
+                }
+
+                *delivered = c->fanout;
                 continue;
             }
 
-            if (u->source.node && u->source.node != target) {
-                c->target.node = target;
-                return 0;
-            }
+            while (u != NULL && *delivered < c->fanout) {
+                if (u->source.node && u->source.node != target) {
+                    c->fanout_behind = 1;
+                    break;
+                }
 
-            u->source.node = target;
+                /* A line part way sent is the one after delivered. A member that falls too far behind
+                 * is disconnected rather than miss lines, even one stuck part way through a line. */
+                size_t p;
+                if (u->source.node == target) {
+                    p = channel_next_line(c, *delivered);
+                    if (p == 0) {
+                        u->source.node = NULL;
+                        u->senddata_size = 0;
+                    }
+                }
+                else if (user_quantum(c, list) <= 0) {
+                    c->target.node = target;
+                    return 0;
+                }
+                else {
+                    p = channel_next_line(c, *delivered);
+                }
 
-            int n = user_send(u, data, size);
-            if (n < 0) {
-                c->target.node = target;
-                return n;
+                if (p == 0) {
+                    u->sendq_exceeded = 1;
+                    *delivered = c->fanout;
+                    break;
+                }
+
+                historyentry *e = historylog_entry(&history, p);
+                if (e->except != (size_t) (u - (*list)->node + 1)) {
+                    u->source.node = target;
+
+                    char *data = (char *) (e + 1);
+                    int n = u->tagdata ? user_send(u, data, e->size) : user_send(u, data + e->tags, e->size - e->tags);
+                    if (n == 0) {
+                        c->fanout_behind = 1;
+                        break;
+                    }
+
+                    u->source.node = NULL;
+                }
+
+                *delivered = p;
             }
-            target->target.offset++;
         }
         target->target.offset = 0;
     }
@@ -687,6 +3401,39 @@ int user_send(node *u, char *data, size_t size) {
     return 1;
 }
 
+/* Sends a line built from state that may change before a partial send resumes, like a channel's
+ * members. What doesn't go at once is kept for user_flush, which the next line waits for, so the
+ * caller may move its cursor on as though the line had gone in full. */
+int user_send_line(node *u, char *data, size_t size) {
+    int n = user_flush(u);
+    if (n <= 0) {
+        return n;
+    }
+
+    if (u->source.node && u->source.node != u) {
+        return 0;
+    }
+
+    u->source.node = u;
+
+    n = user_send(u, data, size);
+    if (n != 0) {
+        u->source.node = NULL;
+        return n;
+    }
+
+    /* Failing to keep it, the line is built again to resume, as user_send expects. */
+    u->keptdata = malloc(size - u->senddata_size);
+    if (u->keptdata == NULL) {
+        return 0;
+    }
+
+    u->keptdata_size = size - u->senddata_size;
+    memcpy(u->keptdata, data + u->senddata_size, u->keptdata_size);
+    u->senddata_size = 0;
+    return 1;
+}
+
 int sendf(node *n, char *format, ...) {
     va_list list, copy;
     va_start(list, format);
@@ -697,6 +3444,5 @@ int sendf(node *n, char *format, ...) {
 
     va_end(list);
     va_end(copy);
-    return n->evaluate == channel_info ? channel_send(n, data, sizeof data - 1)
-                                       : user_send(n, data, sizeof data - 1);
+    return user_send(n, data, sizeof data - 1);
 }
\ No newline at end of file
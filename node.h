@@ -1,22 +1,42 @@
 #ifndef INCLUDE_NODE_H
 #define INCLUDE_NODE_H
 
+#include "capture.h"
+#include "history.h"
+#include "mask.h"
 #include "sock.h"
 
+#include <time.h>
+
 struct casemap;
 struct node;
 struct nodeinfo;
 
 typedef int evaluator(struct node *, struct nodeinfo **);
+typedef int enumerator(struct node *, struct nodeinfo **, struct node *);
 
 typedef struct casemap {
     char *description;
     int (*tolower)(int);
 } casemap;
 
+/* Each casemapping folds 'A' through its last uppercase character onto the 32 characters above.
+ * CASEMAPPING is fixed at build time, so the hot paths fold through CASEMAPPING_TOLOWER, which
+ * expands inline for it, rather than calling CASEMAPPING.tolower. Arguments are evaluated more than
+ * once, and taken as unsigned char like tolower's, so plain char arguments fold the same everywhere. */
+#define ascii_upper          'Z'
+#define strict_rfc1459_upper ']'
+#define rfc1459_upper        '^'
+
+#define CASEMAPPING_UPPER         CASEMAPPING_UPPER_EXPAND(CASEMAPPING)
+#define CASEMAPPING_UPPER_EXPAND(map) CASEMAPPING_UPPER_PASTE(map)
+#define CASEMAPPING_UPPER_PASTE(map)  map##_upper
+#define CASEMAPPING_TOLOWER(c)    ((unsigned char) (c) >= 'A' && (unsigned char) (c) <= CASEMAPPING_UPPER ? (unsigned char) (c) + ('a' - 'A') : (unsigned char) (c))
+
 typedef struct evaluatorinfo {
     char *name;
     evaluator *evaluate;
+    evaluator *bare;    /* for commands that take no parameters as well, evaluated in their place; otherwise NULL */
 } evaluatorinfo;
 
 typedef struct node {
@@ -39,6 +59,21 @@ typedef struct node {
         struct node *node[2];
     } next;
 
+    size_t epoch[BROADCASTS]; /* for each broadcast slot, the last broadcast on it delivered to this node */
+
+    struct {
+        size_t quantum;     /* lines left to evaluate this turn */
+        size_t next;        /* index of the next queued node plus one, or zero */
+        unsigned int queued:1;
+        unsigned long long time; /* nodeinfo_clock when the node was queued */
+    } run;
+
+    struct {
+        size_t next;        /* index of the next unused node plus one, or zero */
+        size_t pass;        /* the pass the node was freed in */
+    } free;
+    size_t hold;            /* the pass since which this node has kept other nodes' indexes across turns, or zero */
+
     union {
         struct { /* only valid when evaluate is set to user_* functions (except for user_channel) */
             sockfd fd;
@@ -52,10 +87,52 @@ typedef struct node {
             size_t recvdata_size;
             int    recvdata_past;
             size_t senddata_size;
+            char *keptdata;      /* the rest of a line user_send_line couldn't send at once, or NULL */
+            size_t keptdata_size;
+
+            char *tagdata;       /* for clients that negotiated message-tags, TAGLEN bytes; otherwise NULL */
+            size_t tagdata_size; /* bytes of the current line's tag section, from the '@' through the space */
+
+            size_t broadcast;   /* epoch of the broadcast in progress, or zero */
+            size_t broadcast_id; /* the slot it holds, as in nodeinfo's broadcast */
+            size_t broadcast_block, broadcast_slot; /* the channel it is at, as for user_next_channel */
+            size_t broadcast_user_block, broadcast_user_slot; /* and the member, as for channel_next_user */
+
+            unsigned int registered:1;
+            size_t capture;     /* connection number in the capture log, the node index plus one, or zero when not captured */
+            unsigned int negotiating:1; /* registration waits for CAP END */
+            unsigned int collided:1; /* a server link killed it over its nickname */
+            unsigned int sendq_exceeded:1; /* it fell more than HISTORYLEN lines behind a channel */
+            size_t link;        /* for remote users, index of the server link they are behind plus one, or zero */
+            size_t next_link;   /* for server links, index of the next link plus one, or zero */
+            size_t burst;       /* for server links, index of the next node to burst */
+            unsigned long long burst_time; /* for server links, nodeinfo_clock when the burst began */
+            char *linkdata;     /* for server links, records batched until the link next runs */
+            size_t linkdata_size;
+            size_t linkdata_capacity;
+
+            size_t target_size;
+            size_t target_sent;
+            size_t target_index[MAXTARGETS]; /* node indexes plus one, or zero where no such nick exists */
+
+            size_t header_size;
+            char header[1 + NICKLEN + 1 + USERLEN + 1 + HOSTLEN + sizeof " PRIVMSG "];
+
+            char query[NICKLEN]; /* the last nickname replied to by a query in progress */
+            size_t query_block;  /* for a query over a channel's members, index of the channel_user node plus one, or zero */
+            size_t query_slot;   /* and the slot within it of the next member to reply with */
+
+            size_t history_channel; /* for a history query in progress, index of the channel plus one */
+            time_t history_since;
+            size_t history_after;   /* log positions plus one bounding the entries left to replay */
+            size_t history_end;
+            size_t history_part;    /* for a PART in progress, log position plus one of the line announcing it */
 
             char recvdata[512];
             char username[USERLEN];
             char hostname[HOSTLEN];
+            unsigned char address[16]; /* hostname as an IPv6 address, IPv4 being mapped */
+            size_t ban;                /* index in bans of the ban registration matched plus one, or zero */
         };
 
         struct { /* only valid when evaluate is set to channel_info */
@@ -66,7 +143,12 @@ typedef struct node {
                size_t offset;
                struct node *node;
             } first_user;
-            unsigned int invite_only   :1,
+            size_t users;        /* members, as counted by LIST */
+            size_t history_last; /* log position of the newest message plus one, or zero */
+            size_t fanout;       /* log position plus one of the newest message the pass over the members in progress delivers, or zero */
+            size_t fanout_done;  /* log position of the last message delivered to every member plus one */
+            unsigned int fanout_behind :1, /* a member was passed over while busy, so the pass is to be repeated */
+                         invite_only   :1,
                          moderate      :1,
                          private       :1,
                          secret        :1,
@@ -78,9 +160,12 @@ typedef struct node {
                size_t offset;
                struct node *node;
             } next_user;
-            union {
-               size_t offset;
-               struct node *node;
+            struct {
+                union {
+                   size_t offset;
+                   struct node *node;
+                };
+                size_t delivered; /* log position of the last message delivered to the member plus one */
             } user[];
         };
 
@@ -97,12 +182,39 @@ typedef struct node {
     };
 } node;
 
+#define NODEINFO_MAGIC  "expircd snapshot 2"
+#define NODEINFO_LAYOUT 256 /* entries nodeinfo_layout may list */
+
+/* Server link records are a type byte and a payload size in two bytes, most significant first,
+ * followed by the payload: fields separated by '\0', the last one running to the end. */
+#define SERVER_RECORD_HEADER 3
+#define SERVER_RECORD_SIZE   (sizeof ((node *) NULL)->recvdata)
+#define SERVER_JOIN     'J' /* nickname, channel */
+#define SERVER_KILL     'K' /* nickname taken on both sides of the link at once */
+#define SERVER_MESSAGE  'M' /* source nickname, PRIVMSG or NOTICE, target nickname or channel, text */
+#define SERVER_NICKNAME 'N' /* old nickname, new nickname */
+#define SERVER_PART     'P' /* nickname, channel, reason */
+#define SERVER_QUIT     'Q' /* nickname, reason */
+#define SERVER_USER     'U' /* nickname, username, hostname */
+
 typedef struct nodeinfo {
     size_t size;
     union {
         size_t offset;
         node *node;
     } root;
+    size_t epoch;
+    size_t broadcast[BROADCASTS]; /* epoch of the broadcast holding each slot, or zero when free */
+    size_t first_link;      /* index of the first server link plus one, or zero */
+    size_t pass;            /* passes over the nodes so far, counting from one */
+    size_t quiescent;       /* the oldest pass a node may still hold indexes from; nodes freed before it are reused */
+    size_t first_free, last_free; /* unused nodes, oldest first, as indexes plus one, or zero when empty */
+    struct {
+        size_t first, last; /* node indexes plus one, or zero when empty */
+        size_t size;
+        size_t count;       /* nodes dequeued so far */
+        unsigned long long delay, delay_max; /* microseconds */
+    } runqueue;
     node node[];
 } nodeinfo;
 
@@ -113,62 +225,180 @@ typedef struct nodeinfo {
 #include <stdio.h>
 #include <string.h>
 
+/* Every evaluator a node may be left at between turns. Each is declared here and named in
+ * evaluatorinfo_all from this one list, so a snapshot can carry every node over. */
+#define EVALUATORS(X) \
+    X(channel_info) \
+    X(channel_user) \
+    X(node_unused) \
+    X(server_accept) \
+    X(server_link) \
+    X(server_link_accept) \
+    X(server_link_burst) \
+    X(server_user) \
+    X(server_user_quit) \
+    X(user_channel) \
+    X(user_participation) \
+    X(user_participation_cannot_send) \
+    X(user_participation_capability) \
+    X(user_participation_capability_request) \
+    X(user_participation_chathistory) \
+    X(user_participation_chathistory_limit) \
+    X(user_participation_chathistory_reference) \
+    X(user_participation_chathistory_replay) \
+    X(user_participation_chathistory_target) \
+    X(user_participation_discard_line) \
+    X(user_participation_erroneous_nickname) \
+    X(user_participation_join) \
+    X(user_participation_join_next) \
+    X(user_participation_join_no_such_channel) \
+    X(user_participation_join_relay) \
+    X(user_participation_list) \
+    X(user_participation_list_all) \
+    X(user_participation_names) \
+    X(user_participation_names_all) \
+    X(user_participation_no_such_channel) \
+    X(user_participation_not_on_channel) \
+    X(user_participation_nickname) \
+    X(user_participation_nickname_in_use) \
+    X(user_participation_nickname_success) \
+    X(user_participation_not_enough_parameters) \
+    X(user_participation_notice) \
+    X(user_participation_notice_handler) \
+    X(user_participation_part) \
+    X(user_participation_part_leave) \
+    X(user_participation_part_next) \
+    X(user_participation_part_no_such_channel) \
+    X(user_participation_part_not_on_channel) \
+    X(user_participation_part_relay) \
+    X(user_participation_privmsg) \
+    X(user_participation_privmsg_handler) \
+    X(user_participation_quit) \
+    X(user_participation_quit_collision) \
+    X(user_participation_quit_error) \
+    X(user_participation_quit_lost) \
+    X(user_participation_quit_sendq) \
+    X(user_participation_relay_message) \
+    X(user_participation_too_many_targets) \
+    X(user_participation_unknown_command) \
+    X(user_participation_username) \
+    X(user_participation_welcome) \
+    X(user_participation_welcome_isupport) \
+    X(user_participation_who) \
+    X(user_registration) \
+    X(user_registration_banned) \
+    X(user_registration_capability) \
+    X(user_registration_capability_request) \
+    X(user_registration_discard_line) \
+    X(user_registration_erroneous_nickname) \
+    X(user_registration_nickname) \
+    X(user_registration_nickname_in_use) \
+    X(user_registration_nickname_success) \
+    X(user_registration_not_enough_parameters) \
+    X(user_registration_unknown_command) \
+    X(user_registration_username)
+
+#define EVALUATOR_PROTOTYPE(e) int e(node *, nodeinfo **);
+EVALUATORS(EVALUATOR_PROTOTYPE)
+#undef EVALUATOR_PROTOTYPE
+
+extern casemap ascii, strict_rfc1459, rfc1459;
+
 int ascii_tolower(int);
 int strict_rfc1459_tolower(int);
 int rfc1459_tolower(int);
 
-int channel_info(node *, nodeinfo **);
-int channel_user(node *, nodeinfo **);
+int channel_history(node *, node *);
+size_t channel_delivered(node *, node *);
+int channel_join(nodeinfo **, node *, node *);
+int channel_member(node *, node *);
+size_t channel_next_line(node *, size_t);
+node *channel_next_user(nodeinfo **, node *, size_t *, size_t *);
+void channel_part(nodeinfo **, node *, node *);
+int channel_send(node *, nodeinfo **);
 
 size_t node_bit(void *, size_t, size_t);
 int node_cleanup(node *, nodeinfo **);
 size_t node_compare(void *, void *, size_t, size_t);
+uint64_t node_fold(void *);
+int node_holds(node *);
+int node_enumerate(node *, char *, size_t, void *, size_t, node *, nodeinfo **, enumerator *);
+int node_enumerate_match(node *, char *, size_t, void *, node *, nodeinfo **, enumerator *);
+int node_enumerate_side(node *, size_t, void *, size_t);
+int node_match(void *, char *, size_t);
 
 node *nodeinfo_add(nodeinfo **, node *);
 void nodeinfo_bind(nodeinfo **, addrinfo *, evaluator *);
+unsigned long long nodeinfo_clock(void);
+node *nodeinfo_connect(nodeinfo **, addrinfo *);
+size_t nodeinfo_drain(nodeinfo **);
+void nodeinfo_enqueue(nodeinfo **, node *);
+int nodeinfo_enumerate(nodeinfo **, char *, size_t, void *, node *, enumerator *);
+void nodeinfo_free(nodeinfo **, node *);
+void nodeinfo_freeze(nodeinfo *);
 node *nodeinfo_get(nodeinfo **, void *, size_t);
 node **nodeinfo_getref(nodeinfo **, void *, size_t);
+size_t nodeinfo_getv(nodeinfo **, char *, size_t, size_t *, size_t);
+void nodeinfo_insert(nodeinfo **, node *);
+size_t nodeinfo_layout(size_t *);
+size_t nodeinfo_layout_bit(node *);
+node *nodeinfo_link(nodeinfo **, sockfd);
+nodeinfo *nodeinfo_load(FILE *);
+void nodeinfo_quiesce(nodeinfo **);
+void nodeinfo_remove(nodeinfo **, node *);
+int nodeinfo_run(nodeinfo **, size_t);
+int nodeinfo_save(nodeinfo **, FILE *);
+void nodeinfo_thaw(nodeinfo *);
 
+evaluatorinfo *evaluatorinfo_all(size_t *);
 int evaluatorinfo_compare(const void *, const void *);
 
-int server_accept(node *, nodeinfo **);
+int server_link_append(node *, int, char *, size_t);
+int server_link_cleanup(node *, nodeinfo **);
+int server_link_evaluate(node *, nodeinfo **);
+int server_link_join(node *, nodeinfo **, char *, size_t);
+int server_link_message(node *, nodeinfo **, char *, size_t);
+size_t server_link_pack(char *, size_t, ...);
+int server_link_part(node *, nodeinfo **, char *, size_t);
+void server_link_propagate(nodeinfo **, size_t, int, char *, size_t);
+size_t server_link_unpack(char *, size_t, char **, size_t *, size_t);
+size_t server_link_user(node *, char *);
+void server_user_remove(nodeinfo **, node *, char *, size_t);
 
-int user_channel(node *, nodeinfo **);
+int user_broadcast(node *, nodeinfo **, char *, size_t);
+int user_broadcast_begin(node *, nodeinfo **);
+void user_broadcast_end(node *, nodeinfo **);
+int user_capability(node *, nodeinfo **, evaluator *, evaluator *);
+int user_capability_request(node *, nodeinfo **, evaluator *);
 int user_discard(node *);
 int user_discard_line(node *);
 int user_error(node *, nodeinfo **, evaluator *, char *);
+int user_flush(node *);
+int user_quantum(node *, nodeinfo **);
 int user_handle(node *, nodeinfo **, evaluatorinfo *, size_t, evaluator *, evaluator *);
-int user_nickname(node *, nodeinfo **, evaluator *, evaluator *);
+int user_list_next(node *);
+size_t user_list_size(node *);
+int user_local(node *);
+int user_nickname(node *, nodeinfo **, evaluator *, evaluator *, evaluator *);
 int user_nickname_success(node *, nodeinfo **, evaluator *);
-int user_participation(node *, nodeinfo **);
-int user_participation_discard_line(node *, nodeinfo **);
-int user_participation_join(node *, nodeinfo **);
-int user_participation_nickname(node *, nodeinfo **);
-int user_participation_nickname_success(node *, nodeinfo **);
-int user_participation_nickname_in_use(node *, nodeinfo **);
-int user_participation_no_such_entity(node *, nodeinfo **);
-int user_participation_not_enough_parameters(node *, nodeinfo **);
+node *user_next_channel(nodeinfo **, node *, size_t *, size_t *);
+int user_participation_error(node *, nodeinfo **, char *);
+int user_participation_list_error(node *, nodeinfo **, evaluator *, char *);
+int user_participation_list_reply(node *, nodeinfo **, node *);
+int user_participation_names_channel(node *, nodeinfo **, node *);
+int user_participation_names_reply(node *, nodeinfo **, node *);
 int user_participation_message(node *, nodeinfo **, evaluator *);
-int user_participation_notice(node *, nodeinfo **);
-int user_participation_notice_handler(node *, nodeinfo **);
-int user_participation_privmsg(node *, nodeinfo **);
-int user_participation_privmsg_handler(node *, nodeinfo **);
+int user_participation_quit_closed(node *, nodeinfo **, char *);
 int user_participation_relay_header(node *, nodeinfo **, char *);
-int user_participation_relay_message(node *, nodeinfo **);
-int user_participation_unknown_command(node *, nodeinfo **);
-int user_participation_username(node *, nodeinfo **);
-int user_participation_welcome(node *, nodeinfo **);
+int user_participation_who_channel(node *, nodeinfo **, node *);
+int user_participation_who_line(node *, nodeinfo **, char *, node *);
+int user_participation_who_reply(node *, nodeinfo **, node *);
 int user_recv(node *);
-int user_registration(node *, nodeinfo **);
-int user_registration_discard_line(node *, nodeinfo **);
-int user_registration_nickname(node *, nodeinfo **);
-int user_registration_nickname_success(node *, nodeinfo **);
-int user_registration_nickname_in_use(node *, nodeinfo **);
-int user_registration_not_enough_parameters(node *, nodeinfo **);
-int user_participation_notice(node *, nodeinfo **);
-int user_participation_privmsg(node *, nodeinfo **);
-int user_registration_unknown_command(node *, nodeinfo **);
-int user_registration_username(node *, nodeinfo **);
+int user_recv_tags(node *);
+void user_recv_tags_filter(node *);
+int user_registration_error(node *, nodeinfo **, char *);
+maskinfo *user_registration_match(node *);
 int user_send(node *, char *, size_t);
+int user_send_line(node *, char *, size_t);
 int sendf(node *, char *, ...);
 #endif
\ No newline at end of file
@@ -0,0 +1,168 @@
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+/* Reads and throws away whatever the server has sent, so it never blocks on a full socket. */
+unsigned long long replay_drain(sockfd *fd, size_t size) {
+    unsigned long long received = 0;
+    char data[4096];
+
+    for (size_t x = 0; x < size; x++) {
+        int n;
+        while (!sock_invalid(fd[x]) && (n = recv(fd[x], data, sizeof data, 0)) > 0) {
+            received += n;
+        }
+    }
+
+    return received;
+}
+
+void replay_sleep(unsigned long long milliseconds) {
+#   ifdef WIN32
+    Sleep(milliseconds);
+#   else
+    usleep(milliseconds * 1000);
+#   endif
+}
+
+int main(int argc, char **argv) {
+    int fast = argc > 1 && strcmp(argv[1], "-f") == 0;
+    if (argc != 4 + fast) {
+        fputs("Usage: replay [-f] capture host port\n"
+              "Replays a capture log against a server, at the pace it was recorded or with -f as fast as possible.\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+#   ifdef WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa)) {
+        fputs("FATAL: WSAStartup failed.", stderr);
+        return EXIT_FAILURE;
+    }
+#   endif
+
+    capturelog log;
+    if (!capturelog_open(&log, argv[1 + fast], "rb")) {
+        fputs("FATAL: Opening the capture log failed.", stderr);
+        return EXIT_FAILURE;
+    }
+
+    addrinfo *addr;
+    if (getaddrinfo(argv[2 + fast], argv[3 + fast], &(addrinfo){ .ai_family = AF_UNSPEC,
+                                                                 .ai_socktype = SOCK_STREAM }, &addr) != 0) {
+        fputs("FATAL: Resolving the server failed.", stderr);
+        return EXIT_FAILURE;
+    }
+
+    /* Connections are indexed by their number in the capture, which is dense: the server's node indexes. */
+    sockfd *fd = NULL;
+    size_t fd_size = 0, records = 0, connections = 0;
+    unsigned long long sent = 0, received = 0, start = capturelog_clock(), base = start, first = 0;
+
+    static char data[65535];
+    int type;
+    size_t connection, size;
+    unsigned long long elapsed;
+
+    while (capturelog_read(&log, &type, &connection, &elapsed, data, &size) > 0) {
+        if (records++ == 0) {
+            first = elapsed;
+        }
+
+        /* The server started a new base, after a restart or a reboot; pace from here on by it. */
+        if (type == CAPTURE_BASE) {
+            base = capturelog_clock();
+            first = elapsed;
+            continue;
+        }
+
+        /* Pace by the capture's clock, keeping up with what the server sends meanwhile. */
+        while (!fast && capturelog_clock() - base < elapsed - first) {
+            received += replay_drain(fd, fd_size);
+            unsigned long long wait = elapsed - first - (capturelog_clock() - base);
+            replay_sleep(wait < 10 ? wait : 10);
+        }
+
+        if (connection >= fd_size) {
+            size_t new_size = connection + 1 > fd_size * 2 ? connection + 1 : fd_size * 2;
+            void *temp = realloc(fd, new_size * sizeof *fd);
+            if (temp == NULL) {
+                fputs("FATAL: Out of memory.", stderr);
+                return EXIT_FAILURE;
+            }
+
+            fd = temp;
+            while (fd_size < new_size) {
+                fd[fd_size++] = (sockfd) -1;
+            }
+        }
+
+        if (type == CAPTURE_OPEN) {
+            fd[connection] = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (!sock_invalid(fd[connection]) && (connect(fd[connection], addr->ai_addr, addr->ai_addrlen) != 0 || !set_nonblock(fd[connection]))) {
+                closesocket(fd[connection]);
+                fd[connection] = (sockfd) -1;
+            }
+
+            if (sock_invalid(fd[connection])) {
+                fprintf(stderr, "ERROR: Connecting for connection %zu failed; skipping it.\n", connection);
+                continue;
+            }
+
+            connections++;
+        }
+        else if (type == CAPTURE_DATA && !sock_invalid(fd[connection])) {
+            for (size_t x = 0; x < size; ) {
+                int n = send(fd[connection], data + x, size - x, 0);
+                if (n < 0 && !sock_again(fd[connection])) {
+                    closesocket(fd[connection]);
+                    fd[connection] = (sockfd) -1;
+                    break;
+                }
+
+                if (n > 0) {
+                    x += n;
+                    sent += n;
+                    continue;
+                }
+
+                received += replay_drain(fd, fd_size);
+                replay_sleep(1);
+            }
+        }
+        else if (type == CAPTURE_CLOSE && !sock_invalid(fd[connection])) {
+            closesocket(fd[connection]);
+            fd[connection] = (sockfd) -1;
+        }
+    }
+
+    /* Give the server a moment to answer the last lines before hanging up on it. */
+    for (unsigned int x = 0; x < 100; x++) {
+        received += replay_drain(fd, fd_size);
+        replay_sleep(10);
+    }
+
+    unsigned long long duration = capturelog_clock() - start;
+    printf("Replayed %zu records over %zu connections in %llu.%03llu seconds; sent %llu bytes and received %llu bytes\n",
+           records, connections, duration / 1000, duration % 1000, sent, received);
+
+    for (size_t x = 0; x < fd_size; x++) {
+        if (!sock_invalid(fd[x])) {
+            closesocket(fd[x]);
+        }
+    }
+
+    free(fd);
+    freeaddrinfo(addr);
+#   ifdef WIN32
+    WSACleanup();
+#   endif
+    return EXIT_SUCCESS;
+}